@@ -0,0 +1,309 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * User space library for the Si700x USB Evaluation Board driver.
+ * The batch decoders unpack DATAh and DATAl from the records, apply the
+ * shifts and convert with the macros of si700x.h. The vector versions
+ * only do the unpacking, the shifts and the 32 bit arithmetic, the
+ * humidity linearization comes from a table built from the same macros
+ * and the 64 bit temperature compensation runs in a scalar pass, so all
+ * the versions give the same numbers as the driver.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SI700X_X86
+#endif
+
+#include "libsi700x.h"
+
+/* Attempts of a shared memory read before giving up */
+#define SHM_READ_TRIES		10000
+
+/*
+ * Conversion tables, expanded by the preprocessor from the macros of
+ * si700x.h so they are computed at compile time and bit exact with the
+ * driver. Each TABLE_n(f, i) expands to f(i) ... f(i + n - 1).
+ */
+#define TABLE_1(f, i)		f(i),
+#define TABLE_4(f, i)		TABLE_1(f, i) TABLE_1(f, i + 1) \
+				TABLE_1(f, i + 2) TABLE_1(f, i + 3)
+#define TABLE_16(f, i)		TABLE_4(f, i) TABLE_4(f, i + 4) \
+				TABLE_4(f, i + 8) TABLE_4(f, i + 12)
+#define TABLE_64(f, i)		TABLE_16(f, i) TABLE_16(f, i + 16) \
+				TABLE_16(f, i + 32) TABLE_16(f, i + 48)
+#define TABLE_256(f, i)		TABLE_64(f, i) TABLE_64(f, i + 64) \
+				TABLE_64(f, i + 128) TABLE_64(f, i + 192)
+#define TABLE_1024(f, i)	TABLE_256(f, i) TABLE_256(f, i + 256) \
+				TABLE_256(f, i + 512) TABLE_256(f, i + 768)
+#define TABLE_4096(f, i)	TABLE_1024(f, i) TABLE_1024(f, i + 1024) \
+				TABLE_1024(f, i + 2048) TABLE_1024(f, i + 3072)
+#define TABLE_16384(f, i)	TABLE_4096(f, i) TABLE_4096(f, i + 4096) \
+				TABLE_4096(f, i + 8192) TABLE_4096(f, i + 12288)
+
+#define HUMIDITY_ENTRY(raw)	HUMIDITY_LINEAR(HUMIDITY_MILLI(raw))
+
+const int32_t si700x_temperature_table[TEMPERATURE_CODES] = {
+	TABLE_16384(TEMPERATURE_MILLI, 0)
+};
+
+const int32_t si700x_humidity_table[HUMIDITY_CODES] = {
+	TABLE_4096(HUMIDITY_ENTRY, 0)
+};
+
+static size_t decode_temperature_scalar(const struct transfer_req *records,
+		size_t count, int32_t *values)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		values[i] = si700x_temperature_table[TEMPERATURE_RAW(
+			records[i].data[0], records[i].data[1])];
+	return count;
+}
+
+static size_t decode_humidity_scalar(const struct transfer_req *records,
+		size_t count, int32_t *values)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		values[i] = si700x_humidity_table[HUMIDITY_RAW(
+			records[i].data[0], records[i].data[1])];
+	return count;
+}
+
+#ifdef SI700X_X86
+
+/*
+ * Decode 8 records per iteration. The data words of the records are
+ * gathered with a shuffle and a lane permutation, then DATAh and DATAl are
+ * masked out of them. Returns the number of records decoded.
+ */
+__attribute__((target("avx2")))
+static size_t decode_avx2(const struct transfer_req *records, size_t count,
+		int32_t *values, int humidity)
+{
+	const __m256i mask = _mm256_set1_epi32(0xFF);
+	const __m256i scale = _mm256_set1_epi32(1000);
+	const __m256i offset = _mm256_set1_epi32(TEMPERATURE_OFFSET * 1000);
+	__m256 a, b;
+	__m256i data, high, low, raw;
+	size_t i;
+
+	for (i = 0; i + 8 <= count; i += 8) {
+		a = _mm256_loadu_ps((const float *)(records + i));
+		b = _mm256_loadu_ps((const float *)(records + i + 4));
+		data = _mm256_castps_si256(_mm256_shuffle_ps(a, b,
+			_MM_SHUFFLE(3, 1, 3, 1)));
+		data = _mm256_permute4x64_epi64(data, _MM_SHUFFLE(3, 1, 2, 0));
+		high = _mm256_and_si256(data, mask);
+		low = _mm256_and_si256(_mm256_srli_epi32(data, 8), mask);
+
+		if (humidity) {
+			raw = _mm256_or_si256(_mm256_slli_epi32(high, 4),
+				_mm256_srli_epi32(low, 4));
+			raw = _mm256_i32gather_epi32(si700x_humidity_table, raw, 4);
+		} else {
+			raw = _mm256_or_si256(_mm256_slli_epi32(high, 6),
+				_mm256_srli_epi32(low, 2));
+			raw = _mm256_srli_epi32(_mm256_mullo_epi32(raw, scale), 5);
+			raw = _mm256_sub_epi32(raw, offset);
+		}
+		_mm256_storeu_si256((__m256i *)(values + i), raw);
+	}
+	return i;
+}
+
+/* Decode 4 records per iteration, as decode_avx2() without the gather */
+__attribute__((target("sse4.1")))
+static size_t decode_sse41(const struct transfer_req *records, size_t count,
+		int32_t *values, int humidity)
+{
+	const __m128i mask = _mm_set1_epi32(0xFF);
+	const __m128i scale = _mm_set1_epi32(1000);
+	const __m128i offset = _mm_set1_epi32(TEMPERATURE_OFFSET * 1000);
+	int32_t codes[4];
+	__m128 a, b;
+	__m128i data, high, low, raw;
+	size_t i;
+
+	for (i = 0; i + 4 <= count; i += 4) {
+		a = _mm_loadu_ps((const float *)(records + i));
+		b = _mm_loadu_ps((const float *)(records + i + 2));
+		data = _mm_castps_si128(_mm_shuffle_ps(a, b,
+			_MM_SHUFFLE(3, 1, 3, 1)));
+		high = _mm_and_si128(data, mask);
+		low = _mm_and_si128(_mm_srli_epi32(data, 8), mask);
+
+		if (humidity) {
+			raw = _mm_or_si128(_mm_slli_epi32(high, 4),
+				_mm_srli_epi32(low, 4));
+			_mm_storeu_si128((__m128i *)codes, raw);
+			values[i] = si700x_humidity_table[codes[0]];
+			values[i + 1] = si700x_humidity_table[codes[1]];
+			values[i + 2] = si700x_humidity_table[codes[2]];
+			values[i + 3] = si700x_humidity_table[codes[3]];
+		} else {
+			raw = _mm_or_si128(_mm_slli_epi32(high, 6),
+				_mm_srli_epi32(low, 2));
+			raw = _mm_srli_epi32(_mm_mullo_epi32(raw, scale), 5);
+			raw = _mm_sub_epi32(raw, offset);
+			_mm_storeu_si128((__m128i *)(values + i), raw);
+		}
+	}
+	return i;
+}
+
+/* Decode the longest vector friendly prefix of the records */
+static size_t decode_vector(const struct transfer_req *records, size_t count,
+		int32_t *values, int humidity)
+{
+	if (__builtin_cpu_supports("avx2"))
+		return decode_avx2(records, count, values, humidity);
+	if (__builtin_cpu_supports("sse4.1"))
+		return decode_sse41(records, count, values, humidity);
+	return 0;
+}
+
+#else
+
+static size_t decode_vector(const struct transfer_req *records, size_t count,
+		int32_t *values, int humidity)
+{
+	return 0;
+}
+
+#endif
+
+void si700x_decode_temperature(const struct transfer_req *records,
+		size_t count, int32_t *values)
+{
+	size_t done;
+
+	done = decode_vector(records, count, values, 0);
+	decode_temperature_scalar(records + done, count - done, values + done);
+}
+
+void si700x_decode_humidity(const struct transfer_req *records,
+		size_t count, const int32_t *temperatures, int32_t *values)
+{
+	size_t done, i;
+	int32_t value;
+
+	done = decode_vector(records, count, values, 1);
+	decode_humidity_scalar(records + done, count - done, values + done);
+
+	for (i = 0; i < count; i++) {
+		value = values[i];
+		if (temperatures)
+			value = HUMIDITY_COMPENSATE(value, temperatures[i]);
+		values[i] = HUMIDITY_CLAMP(value);
+	}
+}
+
+struct si700x_shm *si700x_shm_open(int writable)
+{
+	struct si700x_shm *shm;
+	int fd, error;
+
+	fd = shm_open(SI700X_SHM_NAME, writable ? O_RDWR | O_CREAT : O_RDONLY,
+		0644);
+	if (fd < 0)
+		return NULL;
+	if (writable && ftruncate(fd, sizeof(*shm)) < 0) {
+		error = errno;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+
+	shm = mmap(NULL, sizeof(*shm), writable ? PROT_READ | PROT_WRITE :
+		PROT_READ, MAP_SHARED, fd, 0);
+	error = errno;
+	close(fd);
+	if (shm == MAP_FAILED) {
+		errno = error;
+		return NULL;
+	}
+
+	if (writable) {
+		memset(shm, 0x00, sizeof(*shm));
+		shm->version = SI700X_SHM_VERSION;
+		__atomic_store_n(&shm->magic, SI700X_SHM_MAGIC, __ATOMIC_RELEASE);
+	} else if (__atomic_load_n(&shm->magic, __ATOMIC_ACQUIRE) !=
+			SI700X_SHM_MAGIC || shm->version != SI700X_SHM_VERSION) {
+		munmap(shm, sizeof(*shm));
+		errno = EPROTO;
+		return NULL;
+	}
+	return shm;
+}
+
+void si700x_shm_close(struct si700x_shm *shm)
+{
+	munmap(shm, sizeof(*shm));
+}
+
+void si700x_shm_write_begin(struct si700x_shm_board *board)
+{
+	__atomic_store_n(&board->sequence, board->sequence + 1,
+		__ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void si700x_shm_write_end(struct si700x_shm_board *board)
+{
+	__atomic_store_n(&board->sequence, board->sequence + 1,
+		__ATOMIC_RELEASE);
+}
+
+int si700x_shm_read(const struct si700x_shm_board *board,
+		struct si700x_shm_board *copy)
+{
+	uint32_t sequence;
+	int tries;
+
+	/* a daemon that died in the middle of an update never finishes it */
+	for (tries = 0; tries < SHM_READ_TRIES; tries++) {
+		sequence = __atomic_load_n(&board->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(copy, (const void *)board, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&board->sequence, __ATOMIC_RELAXED) ==
+				sequence) {
+			copy->sequence = sequence;
+			return 0;
+		}
+	}
+	errno = EAGAIN;
+	return -1;
+}
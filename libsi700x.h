@@ -0,0 +1,257 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * User space library for the Si700x USB Evaluation Board driver.
+ */
+
+#ifndef _LIBSI700X_H
+#define _LIBSI700X_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "si700x.h"
+
+/* Number of temperature and humidity result codes */
+#define TEMPERATURE_CODES  (1 << 14)
+#define HUMIDITY_CODES     (1 << 12)
+
+/*
+ * Conversion tables generated at compile time from the macros of si700x.h,
+ * indexed by the raw result. The humidity table holds the linearized,
+ * uncompensated value. The result registers have the same layout in normal
+ * and fast conversion mode, fast conversions only leave the low bits less
+ * accurate, so the same tables serve both.
+ */
+extern const int32_t si700x_temperature_table[TEMPERATURE_CODES];
+extern const int32_t si700x_humidity_table[HUMIDITY_CODES];
+
+/* Raw temperature result to milli-degree Celsius */
+static inline int32_t si700x_temperature(uint16_t raw)
+{
+	return si700x_temperature_table[raw & (TEMPERATURE_CODES - 1)];
+}
+
+/*
+ * Raw humidity result to milli-percent, compensated for a temperature in
+ * milli-degree Celsius as the driver does
+ */
+static inline int32_t si700x_humidity(uint16_t raw, int32_t temperature)
+{
+	int32_t value = si700x_humidity_table[raw & (HUMIDITY_CODES - 1)];
+
+	value = HUMIDITY_COMPENSATE(value, temperature);
+	return HUMIDITY_CLAMP(value);
+}
+
+/*
+ * Batch decoding of raw results. Each record is the response to a 2 byte
+ * read of REG_DATA, with DATAh in data[0] and DATAl in data[1]. The values
+ * are in milli-degree Celsius and milli-percent and are bit exact with the
+ * conversion of the driver. The humidity is compensated with the matching
+ * entry of temperatures, or left uncompensated if temperatures is NULL,
+ * which is the same as compensating for 30 degree Celsius.
+ * AVX2 or SSE4.1 is used when the processor supports it.
+ */
+void si700x_decode_temperature(const struct transfer_req *records,
+		size_t count, int32_t *values);
+void si700x_decode_humidity(const struct transfer_req *records,
+		size_t count, const int32_t *temperatures, int32_t *values);
+
+/*
+ * Transport to a board. The char device backend goes through the driver
+ * and its /dev/si700xN node. The libusb backend talks to the board
+ * directly, for hosts where the driver can't be loaded : it sends the same
+ * vendor requests on the control pipe and the same packets of transfer
+ * requests on PIPE_DATA_OUT and PIPE_DATA_IN, with several packets in
+ * flight. It is only built when libusb-1.0 is installed. A transport is
+ * not thread safe, open one per thread.
+ */
+struct si700x_transport;
+
+/*
+ * Open a board by name : usb:N is the Nth board found by libusb, usb: the
+ * first, anything else is a device node of the driver. Returns NULL with
+ * errno set on failure.
+ */
+struct si700x_transport *si700x_transport_open(const char *name);
+void si700x_transport_close(struct si700x_transport *t);
+
+/*
+ * Send a REQ_* vendor request. Returns the number of data bytes
+ * transferred or -1 with errno set. The char device backend maps the
+ * requests to the ioctls of the driver and fails others with EINVAL.
+ */
+int si700x_control(struct si700x_transport *t, uint8_t request,
+		uint8_t request_type, uint16_t value, uint16_t index,
+		void *data, uint16_t length);
+
+/*
+ * Send transfer requests, MAX_XFER_COUNT to a packet, and store the
+ * responses in their place. Returns 0, or -1 with errno set if a packet
+ * failed on the USB level. The requests without a response are left with
+ * XFER_STATUS_NONE, which is also what the char device backend returns for
+ * the requests that failed on the bus since the driver drops them.
+ */
+int si700x_transfer(struct si700x_transport *t, struct transfer_req *reqs,
+		size_t count);
+
+/*
+ * Shared memory snapshot published by the si700xd collector daemon. Every
+ * board is protected by its own seqlock : the sequence is odd while the
+ * daemon updates the board, and a reader retries its copy if the sequence
+ * was odd or changed meanwhile. Readers never block the daemon and never
+ * make a system call once the region is mapped.
+ */
+#define SI700X_SHM_NAME    "/si700x"
+#define SI700X_SHM_MAGIC   0x53493758
+#define SI700X_SHM_VERSION 4
+#define SI700X_SHM_BOARDS  32
+
+struct si700x_shm_reading {
+	uint8_t address;		/* slave address */
+	uint8_t port;			/* board port */
+	uint8_t device_id;		/* REG_DEVICE_ID register */
+	uint8_t temperature_status;	/* XFER_STATUS_* */
+	uint8_t humidity_status;
+	uint8_t reserved[3];
+	uint16_t temperature_raw;
+	uint16_t humidity_raw;
+	int32_t temperature;		/* milli-degree Celsius */
+	int32_t humidity;		/* milli-percent */
+	uint64_t time;			/* CLOCK_REALTIME in nanoseconds */
+};
+
+struct si700x_shm_board {
+	uint32_t sequence;		/* seqlock sequence */
+	uint32_t present;		/* 1 while the board is open */
+	uint32_t count;			/* number of slaves */
+	uint32_t reserved;
+	struct si700x_shm_reading slaves[MAX_SLAVE_COUNT];
+	struct si700x_stats stats;	/* driver counters of the board */
+};
+
+struct si700x_shm {
+	uint32_t magic;			/* SI700X_SHM_MAGIC */
+	uint32_t version;		/* SI700X_SHM_VERSION */
+	struct si700x_shm_board boards[SI700X_SHM_BOARDS];
+};
+
+/*
+ * Map the shared memory snapshot, creating it if writable is set. Returns
+ * NULL with errno set on failure.
+ */
+struct si700x_shm *si700x_shm_open(int writable);
+void si700x_shm_close(struct si700x_shm *shm);
+
+/* Publish a board, called by the daemon only */
+void si700x_shm_write_begin(struct si700x_shm_board *board);
+void si700x_shm_write_end(struct si700x_shm_board *board);
+
+/*
+ * Take a consistent copy of a board. Returns 0, or -1 with errno set to
+ * EAGAIN if the board stayed in the middle of an update, which happens
+ * when the daemon died while writing it.
+ */
+int si700x_shm_read(const struct si700x_shm_board *board,
+		struct si700x_shm_board *copy);
+
+/*
+ * Compressed sample log. A log is a pair of files : <path> holds fixed size
+ * blocks of bit packed records and <path>.idx holds one index entry per
+ * block, with the series, the time range and the aggregates of the block.
+ * Each block belongs to one series, the temperature and humidity readings
+ * of one slave. Timestamps are coded as delta of delta and the raw results
+ * as the delta to the previous result of the series, so a slowly changing
+ * reading takes 3 bits. Readers map both files, use the index to skip
+ * blocks outside the range and the aggregates of the blocks inside it, and
+ * only decode the blocks the range cuts.
+ */
+#define SI700X_LOG_MAGIC       0x5349374C
+#define SI700X_LOG_BLOCK_SIZE  4096
+
+struct si700x_log_index {
+	uint32_t magic;			/* SI700X_LOG_MAGIC */
+	uint16_t board;			/* N of /dev/si700xN */
+	uint8_t address;		/* slave address */
+	uint8_t reserved;
+	uint32_t count;			/* records in the block */
+	uint32_t bits;			/* bits used in the block */
+	uint64_t first_time;		/* milliseconds */
+	uint64_t last_time;
+	int32_t temperature_min;	/* milli-degree Celsius */
+	int32_t temperature_max;
+	int64_t temperature_sum;
+	int32_t humidity_min;		/* milli-percent */
+	int32_t humidity_max;
+	int64_t humidity_sum;
+};
+
+struct si700x_log_record {
+	uint64_t time;			/* milliseconds */
+	uint16_t temperature_raw;
+	uint16_t humidity_raw;
+	int32_t temperature;		/* milli-degree Celsius */
+	int32_t humidity;		/* milli-percent, compensated */
+};
+
+struct si700x_log_summary {
+	uint64_t count;
+	int32_t temperature_min;
+	int32_t temperature_max;
+	int64_t temperature_sum;
+	int32_t humidity_min;
+	int32_t humidity_max;
+	int64_t humidity_sum;
+};
+
+struct si700x_log_writer;
+struct si700x_log_reader;
+
+/*
+ * Open a log for appending, creating it if needed. Records of a series
+ * must come in time order. The writer is not thread safe. Full blocks are
+ * written as they fill up, si700x_log_flush() also writes the partial ones.
+ * Functions returning int return 0 or -1 with errno set.
+ */
+struct si700x_log_writer *si700x_log_create(const char *path);
+int si700x_log_append(struct si700x_log_writer *log, unsigned int board,
+		unsigned int address, uint64_t time, uint16_t temperature_raw,
+		uint16_t humidity_raw);
+int si700x_log_flush(struct si700x_log_writer *log);
+int si700x_log_close(struct si700x_log_writer *log);
+
+/*
+ * Map a log for reading. The reader sees the blocks that were flushed when
+ * it was mapped. si700x_log_scan() calls fn for every record of the series
+ * with from <= time <= to and returns the number of records, a non zero
+ * return from fn stops the scan.
+ */
+struct si700x_log_reader *si700x_log_map(const char *path);
+void si700x_log_unmap(struct si700x_log_reader *log);
+size_t si700x_log_scan(const struct si700x_log_reader *log,
+		unsigned int board, unsigned int address, uint64_t from,
+		uint64_t to, int (*fn)(const struct si700x_log_record *, void *),
+		void *arg);
+void si700x_log_aggregate(const struct si700x_log_reader *log,
+		unsigned int board, unsigned int address, uint64_t from,
+		uint64_t to, struct si700x_log_summary *summary);
+
+#endif
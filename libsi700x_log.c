@@ -0,0 +1,634 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Compressed sample log of libsi700x.
+ *
+ * Every record is coded most significant bit first as :
+ *
+ *	timestamp delta of delta, in milliseconds
+ *		0			'0'
+ *		-63 .. 64		'10'   + 7 bits
+ *		-255 .. 256		'110'  + 9 bits
+ *		-2047 .. 2048		'1110' + 12 bits
+ *		32 bit			'1111' + 32 bits
+ *	temperature and humidity raw result, zigzag coded delta
+ *		0			'0'
+ *		< 16			'10'   + 4 bits
+ *		< 256			'110'  + 8 bits
+ *		otherwise		'111'  + 16 bits
+ *
+ * The first record of a block starts from first_time of its index entry
+ * and from raw results of 0.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "libsi700x.h"
+
+#define BLOCK_BITS       (SI700X_LOG_BLOCK_SIZE * 8)
+#define MAX_RECORD_BITS  (4 + 32 + 2 * (3 + 16))
+
+/* Open block of a series */
+struct series {
+	struct si700x_log_index index;
+	uint8_t data[SI700X_LOG_BLOCK_SIZE];
+	uint64_t block;			/* block number in the files */
+	int64_t delta;			/* last timestamp delta */
+	uint16_t temperature_raw;	/* last raw results */
+	uint16_t humidity_raw;
+	int dirty;
+};
+
+struct si700x_log_writer {
+	int data_fd;
+	int index_fd;
+	uint64_t blocks;		/* blocks allocated in the files */
+	struct series **series;
+	size_t count;
+};
+
+struct si700x_log_reader {
+	const uint8_t *data;
+	size_t data_size;
+	const struct si700x_log_index *index;
+	size_t index_size;
+	size_t entries;
+};
+
+struct bit_reader {
+	const uint8_t *data;
+	uint32_t pos;
+	uint32_t bits;
+	int overrun;
+};
+
+static void put_bits(struct series *s, uint64_t value, unsigned int n)
+{
+	unsigned int room, take;
+	uint32_t pos = s->index.bits;
+
+	while (n) {
+		room = 8 - (pos & 7);
+		take = n < room ? n : room;
+		s->data[pos >> 3] |= ((value >> (n - take)) &
+			((1U << take) - 1)) << (room - take);
+		pos += take;
+		n -= take;
+	}
+	s->index.bits = pos;
+}
+
+static uint64_t get_bits(struct bit_reader *br, unsigned int n)
+{
+	unsigned int room, take;
+	uint64_t value = 0;
+
+	if (br->pos + n > br->bits) {
+		br->overrun = 1;
+		return 0;
+	}
+	while (n) {
+		room = 8 - (br->pos & 7);
+		take = n < room ? n : room;
+		value = (value << take) | ((br->data[br->pos >> 3] >>
+			(room - take)) & ((1U << take) - 1));
+		br->pos += take;
+		n -= take;
+	}
+	return value;
+}
+
+/* Number of leading one bits, up to max */
+static unsigned int get_prefix(struct bit_reader *br, unsigned int max)
+{
+	unsigned int ones = 0;
+
+	while (ones < max && get_bits(br, 1))
+		ones++;
+	return ones;
+}
+
+static void put_time(struct series *s, int64_t dod)
+{
+	if (dod == 0) {
+		put_bits(s, 0x0, 1);
+	} else if (dod >= -63 && dod <= 64) {
+		put_bits(s, 0x2, 2);
+		put_bits(s, dod + 63, 7);
+	} else if (dod >= -255 && dod <= 256) {
+		put_bits(s, 0x6, 3);
+		put_bits(s, dod + 255, 9);
+	} else if (dod >= -2047 && dod <= 2048) {
+		put_bits(s, 0xE, 4);
+		put_bits(s, dod + 2047, 12);
+	} else {
+		put_bits(s, 0xF, 4);
+		put_bits(s, (uint32_t)(int32_t)dod, 32);
+	}
+}
+
+static int64_t get_time(struct bit_reader *br)
+{
+	switch (get_prefix(br, 4)) {
+	case 0:
+		return 0;
+	case 1:
+		return (int64_t)get_bits(br, 7) - 63;
+	case 2:
+		return (int64_t)get_bits(br, 9) - 255;
+	case 3:
+		return (int64_t)get_bits(br, 12) - 2047;
+	default:
+		return (int32_t)get_bits(br, 32);
+	}
+}
+
+static void put_value(struct series *s, uint16_t raw, uint16_t last)
+{
+	int32_t delta = (int32_t)raw - last;
+	uint32_t zigzag = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+
+	if (zigzag == 0) {
+		put_bits(s, 0x0, 1);
+	} else if (zigzag < 16) {
+		put_bits(s, 0x2, 2);
+		put_bits(s, zigzag, 4);
+	} else if (zigzag < 256) {
+		put_bits(s, 0x6, 3);
+		put_bits(s, zigzag, 8);
+	} else {
+		put_bits(s, 0x7, 3);
+		put_bits(s, zigzag, 16);
+	}
+}
+
+static uint16_t get_value(struct bit_reader *br, uint16_t last)
+{
+	uint32_t zigzag;
+
+	switch (get_prefix(br, 3)) {
+	case 0:
+		return last;
+	case 1:
+		zigzag = get_bits(br, 4);
+		break;
+	case 2:
+		zigzag = get_bits(br, 8);
+		break;
+	default:
+		zigzag = get_bits(br, 16);
+		break;
+	}
+	return last + (int32_t)((zigzag >> 1) ^ -(zigzag & 1));
+}
+
+static void summary_init(struct si700x_log_summary *summary)
+{
+	memset(summary, 0x00, sizeof(*summary));
+	summary->temperature_min = INT32_MAX;
+	summary->temperature_max = INT32_MIN;
+	summary->humidity_min = INT32_MAX;
+	summary->humidity_max = INT32_MIN;
+}
+
+static void summary_add(struct si700x_log_summary *summary,
+		int32_t temperature, int32_t humidity)
+{
+	summary->count++;
+	if (temperature < summary->temperature_min)
+		summary->temperature_min = temperature;
+	if (temperature > summary->temperature_max)
+		summary->temperature_max = temperature;
+	summary->temperature_sum += temperature;
+	if (humidity < summary->humidity_min)
+		summary->humidity_min = humidity;
+	if (humidity > summary->humidity_max)
+		summary->humidity_max = humidity;
+	summary->humidity_sum += humidity;
+}
+
+static int write_full(int fd, const void *buf, size_t size, off_t offset)
+{
+	ssize_t done;
+
+	while (size) {
+		done = pwrite(fd, buf, size, offset);
+		if (done < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf = (const uint8_t *)buf + done;
+		size -= done;
+		offset += done;
+	}
+	return 0;
+}
+
+/*
+ * Write the block before its index entry, so readers never see an entry
+ * describing more than its block holds
+ */
+static int write_block(struct si700x_log_writer *log, struct series *s)
+{
+	if (write_full(log->data_fd, s->data, SI700X_LOG_BLOCK_SIZE,
+			s->block * SI700X_LOG_BLOCK_SIZE) < 0)
+		return -1;
+	if (write_full(log->index_fd, &s->index, sizeof(s->index),
+			s->block * sizeof(s->index)) < 0)
+		return -1;
+	s->dirty = 0;
+	return 0;
+}
+
+static void start_block(struct si700x_log_writer *log, struct series *s,
+		uint64_t time)
+{
+	unsigned int board = s->index.board;
+	unsigned int address = s->index.address;
+
+	memset(&s->index, 0x00, sizeof(s->index));
+	memset(s->data, 0x00, sizeof(s->data));
+	s->index.magic = SI700X_LOG_MAGIC;
+	s->index.board = board;
+	s->index.address = address;
+	s->index.first_time = time;
+	s->index.last_time = time;
+	s->index.temperature_min = INT32_MAX;
+	s->index.temperature_max = INT32_MIN;
+	s->index.humidity_min = INT32_MAX;
+	s->index.humidity_max = INT32_MIN;
+	s->block = log->blocks++;
+	s->delta = 0;
+	s->temperature_raw = 0;
+	s->humidity_raw = 0;
+}
+
+static struct series *find_series(struct si700x_log_writer *log,
+		unsigned int board, unsigned int address)
+{
+	struct series **series;
+	struct series *s;
+	size_t i;
+
+	for (i = 0; i < log->count; i++) {
+		s = log->series[i];
+		if (s->index.board == board && s->index.address == address)
+			return s;
+	}
+
+	series = realloc(log->series, (log->count + 1) * sizeof(*series));
+	if (!series)
+		return NULL;
+	log->series = series;
+	s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->index.board = board;
+	s->index.address = address;
+	log->series[log->count++] = s;
+	return s;
+}
+
+struct si700x_log_writer *si700x_log_create(const char *path)
+{
+	struct si700x_log_writer *log;
+	char index_path[PATH_MAX];
+	struct stat st;
+	int error;
+
+	if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >=
+			(int)sizeof(index_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	log = calloc(1, sizeof(*log));
+	if (!log)
+		return NULL;
+	log->index_fd = -1;
+
+	log->data_fd = open(path, O_RDWR | O_CREAT, 0644);
+	if (log->data_fd < 0)
+		goto error;
+	log->index_fd = open(index_path, O_RDWR | O_CREAT, 0644);
+	if (log->index_fd < 0)
+		goto error;
+
+	/* new blocks go after the last complete index entry */
+	if (fstat(log->index_fd, &st) < 0)
+		goto error;
+	log->blocks = st.st_size / sizeof(struct si700x_log_index);
+	return log;
+
+error:
+	error = errno;
+	if (log->data_fd >= 0)
+		close(log->data_fd);
+	if (log->index_fd >= 0)
+		close(log->index_fd);
+	free(log);
+	errno = error;
+	return NULL;
+}
+
+int si700x_log_append(struct si700x_log_writer *log, unsigned int board,
+		unsigned int address, uint64_t time, uint16_t temperature_raw,
+		uint16_t humidity_raw)
+{
+	struct series *s;
+	int64_t delta = 0, dod = 0;
+	int32_t temperature, humidity;
+
+	s = find_series(log, board, address);
+	if (!s)
+		return -1;
+
+	if (s->index.count) {
+		if (time < s->index.last_time) {
+			errno = EINVAL;
+			return -1;
+		}
+		delta = time - s->index.last_time;
+		dod = delta - s->delta;
+		if (dod < INT32_MIN || dod > INT32_MAX ||
+				s->index.bits + MAX_RECORD_BITS > BLOCK_BITS) {
+			if (write_block(log, s) < 0)
+				return -1;
+			s->index.count = 0;
+		}
+	}
+	if (!s->index.count) {
+		start_block(log, s, time);
+		delta = 0;
+		dod = 0;
+	}
+
+	temperature_raw &= TEMPERATURE_CODES - 1;
+	humidity_raw &= HUMIDITY_CODES - 1;
+	put_time(s, dod);
+	put_value(s, temperature_raw, s->temperature_raw);
+	put_value(s, humidity_raw, s->humidity_raw);
+
+	temperature = si700x_temperature(temperature_raw);
+	humidity = si700x_humidity(humidity_raw, temperature);
+	if (temperature < s->index.temperature_min)
+		s->index.temperature_min = temperature;
+	if (temperature > s->index.temperature_max)
+		s->index.temperature_max = temperature;
+	s->index.temperature_sum += temperature;
+	if (humidity < s->index.humidity_min)
+		s->index.humidity_min = humidity;
+	if (humidity > s->index.humidity_max)
+		s->index.humidity_max = humidity;
+	s->index.humidity_sum += humidity;
+
+	s->index.count++;
+	s->index.last_time = time;
+	s->delta = delta;
+	s->temperature_raw = temperature_raw;
+	s->humidity_raw = humidity_raw;
+	s->dirty = 1;
+	return 0;
+}
+
+int si700x_log_flush(struct si700x_log_writer *log)
+{
+	size_t i;
+
+	for (i = 0; i < log->count; i++)
+		if (log->series[i]->dirty && write_block(log, log->series[i]) < 0)
+			return -1;
+	return 0;
+}
+
+int si700x_log_close(struct si700x_log_writer *log)
+{
+	int retval, error;
+	size_t i;
+
+	retval = si700x_log_flush(log);
+	error = errno;
+
+	close(log->data_fd);
+	close(log->index_fd);
+	for (i = 0; i < log->count; i++)
+		free(log->series[i]);
+	free(log->series);
+	free(log);
+
+	errno = error;
+	return retval;
+}
+
+static const void *map_file(const char *path, size_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd, error;
+
+	*size = 0;
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		/* errno is left 0 for an empty file */
+		error = st.st_size ? errno : 0;
+		close(fd);
+		errno = error;
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	error = errno;
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = error;
+		return NULL;
+	}
+	*size = st.st_size;
+	return map;
+}
+
+struct si700x_log_reader *si700x_log_map(const char *path)
+{
+	struct si700x_log_reader *log;
+	char index_path[PATH_MAX];
+
+	if (snprintf(index_path, sizeof(index_path), "%s.idx", path) >=
+			(int)sizeof(index_path)) {
+		errno = ENAMETOOLONG;
+		return NULL;
+	}
+
+	log = calloc(1, sizeof(*log));
+	if (!log)
+		return NULL;
+
+	/* an empty log maps to no blocks */
+	log->index = map_file(index_path, &log->index_size);
+	if (!log->index && errno)
+		goto error;
+	log->data = map_file(path, &log->data_size);
+	if (!log->data && errno)
+		goto error;
+
+	log->entries = log->index_size / sizeof(*log->index);
+	if (log->entries > log->data_size / SI700X_LOG_BLOCK_SIZE)
+		log->entries = log->data_size / SI700X_LOG_BLOCK_SIZE;
+
+	/* blocks are only read when a range cuts them */
+	if (log->data)
+		madvise((void *)log->data, log->data_size, MADV_RANDOM);
+	return log;
+
+error:
+	si700x_log_unmap(log);
+	return NULL;
+}
+
+void si700x_log_unmap(struct si700x_log_reader *log)
+{
+	if (log->index)
+		munmap((void *)log->index, log->index_size);
+	if (log->data)
+		munmap((void *)log->data, log->data_size);
+	free(log);
+}
+
+/*
+ * Decode the records of block i within [from, to], passing them to fn and
+ * adding them to summary when given. Returns the number of records, *stop
+ * is set if fn asked to stop.
+ */
+static size_t decode_block(const struct si700x_log_reader *log, size_t i,
+		uint64_t from, uint64_t to,
+		int (*fn)(const struct si700x_log_record *, void *), void *arg,
+		struct si700x_log_summary *summary, int *stop)
+{
+	const struct si700x_log_index *entry = &log->index[i];
+	struct si700x_log_record record;
+	struct bit_reader br;
+	int64_t delta = 0;
+	size_t found = 0;
+	uint32_t k;
+
+	br.data = log->data + i * SI700X_LOG_BLOCK_SIZE;
+	br.pos = 0;
+	br.bits = entry->bits < BLOCK_BITS ? entry->bits : BLOCK_BITS;
+	br.overrun = 0;
+
+	memset(&record, 0x00, sizeof(record));
+	record.time = entry->first_time;
+
+	for (k = 0; k < entry->count; k++) {
+		delta += get_time(&br);
+		record.time += delta;
+		record.temperature_raw = get_value(&br, record.temperature_raw);
+		record.humidity_raw = get_value(&br, record.humidity_raw);
+		if (br.overrun || record.time > to)
+			break;
+		if (record.time < from)
+			continue;
+
+		record.temperature = si700x_temperature(record.temperature_raw);
+		record.humidity = si700x_humidity(record.humidity_raw,
+			record.temperature);
+		found++;
+		if (summary)
+			summary_add(summary, record.temperature,
+				record.humidity);
+		if (fn && fn(&record, arg)) {
+			*stop = 1;
+			break;
+		}
+	}
+	return found;
+}
+
+static int in_series(const struct si700x_log_index *entry,
+		unsigned int board, unsigned int address)
+{
+	return entry->magic == SI700X_LOG_MAGIC && entry->count &&
+		entry->board == board && entry->address == address;
+}
+
+size_t si700x_log_scan(const struct si700x_log_reader *log,
+		unsigned int board, unsigned int address, uint64_t from,
+		uint64_t to, int (*fn)(const struct si700x_log_record *, void *),
+		void *arg)
+{
+	const struct si700x_log_index *entry;
+	size_t i, found = 0;
+	int stop = 0;
+
+	for (i = 0; i < log->entries && !stop; i++) {
+		entry = &log->index[i];
+		if (!in_series(entry, board, address) ||
+				entry->last_time < from || entry->first_time > to)
+			continue;
+		found += decode_block(log, i, from, to, fn, arg, NULL, &stop);
+	}
+	return found;
+}
+
+void si700x_log_aggregate(const struct si700x_log_reader *log,
+		unsigned int board, unsigned int address, uint64_t from,
+		uint64_t to, struct si700x_log_summary *summary)
+{
+	const struct si700x_log_index *entry;
+	size_t i;
+	int stop = 0;
+
+	summary_init(summary);
+	for (i = 0; i < log->entries; i++) {
+		entry = &log->index[i];
+		if (!in_series(entry, board, address) ||
+				entry->last_time < from || entry->first_time > to)
+			continue;
+
+		if (entry->first_time < from || entry->last_time > to) {
+			decode_block(log, i, from, to, NULL, NULL, summary,
+				&stop);
+			continue;
+		}
+
+		/* whole block in the range, the index entry has it all */
+		summary->count += entry->count;
+		if (entry->temperature_min < summary->temperature_min)
+			summary->temperature_min = entry->temperature_min;
+		if (entry->temperature_max > summary->temperature_max)
+			summary->temperature_max = entry->temperature_max;
+		summary->temperature_sum += entry->temperature_sum;
+		if (entry->humidity_min < summary->humidity_min)
+			summary->humidity_min = entry->humidity_min;
+		if (entry->humidity_max > summary->humidity_max)
+			summary->humidity_max = entry->humidity_max;
+		summary->humidity_sum += entry->humidity_sum;
+	}
+}
@@ -0,0 +1,508 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Board transports of libsi700x.
+ *
+ * The char device backend writes the requests to the driver, at most
+ * MAX_XFER_BATCH at a time, and lets it pack them. The libusb backend
+ * packs them itself, MAX_XFER_COUNT to a packet, and keeps up to
+ * USB_WINDOW packets in flight with asynchronous transfers. As in the
+ * driver the IN transfer of a packet is submitted before its OUT transfer,
+ * and since the transfers of an endpoint complete in order, the responses
+ * of the packets come back in the order they were sent. A failed packet
+ * cancels the packets sent after it, their IN transfers would otherwise
+ * take the wrong responses.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifdef SI700X_LIBUSB
+#include <libusb.h>
+#endif
+
+#include "libsi700x.h"
+
+#define USB_VENDOR_ID    0x10c4
+#define USB_PRODUCT_ID   0x8649
+#define USB_INTERFACE    0
+#define USB_TIMEOUT_MS   1000
+#define USB_WINDOW       (MAX_XFER_BATCH / MAX_XFER_COUNT)
+
+struct transport_ops {
+	int (*control)(struct si700x_transport *t, uint8_t request,
+		uint8_t request_type, uint16_t value, uint16_t index,
+		void *data, uint16_t length);
+	int (*transfer)(struct si700x_transport *t, struct transfer_req *reqs,
+		size_t count);
+	void (*close)(struct si700x_transport *t);
+};
+
+#ifdef SI700X_LIBUSB
+/* Packet in flight on the data pipes */
+struct usb_packet {
+	struct libusb_transfer *out;
+	struct libusb_transfer *in;
+	struct transfer_req *reqs;	/* requests of the caller */
+	int count;
+	int pending;			/* transfers not completed yet */
+	int error;			/* errno of the first failure */
+	struct transfer_req out_buffer[MAX_XFER_COUNT];
+	struct transfer_req in_buffer[MAX_XFER_COUNT];
+};
+#endif
+
+struct si700x_transport {
+	const struct transport_ops *ops;
+	int fd;				/* char device */
+#ifdef SI700X_LIBUSB
+	libusb_context *context;
+	libusb_device_handle *handle;
+	struct usb_packet packets[USB_WINDOW];
+#endif
+};
+
+static void fail_requests(struct transfer_req *reqs, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++)
+		reqs[i].status = XFER_STATUS_NONE;
+}
+
+/* Char device backend */
+
+static int chardev_control(struct si700x_transport *t, uint8_t request,
+		uint8_t request_type, uint16_t value, uint16_t index,
+		void *data, uint16_t length)
+{
+	unsigned short version = 0;
+	unsigned char byte = 0;
+	uint8_t *buffer = data;
+
+	/* the ioctl of each request implies the direction */
+	(void)request_type;
+
+	switch (request) {
+	case REQ_SET_LED:
+		return ioctl(t->fd, value ? SI700X_LED_ON : SI700X_LED_OFF);
+	case REQ_SET_PROG:
+		return ioctl(t->fd, value ? SI700X_SETPROG_ON :
+			SI700X_SETPROG_OFF);
+	case REQ_SET_SLEEP:
+		return ioctl(t->fd, value ? SI700X_SETSLEEP_ON :
+			SI700X_SETSLEEP_OFF, (unsigned int)index);
+	case REQ_GET_VERSION:
+		if (length < 2)
+			break;
+		if (ioctl(t->fd, SI700X_VERSION, &version) == -1)
+			return -1;
+		buffer[0] = version & 0xFF;
+		buffer[1] = version >> 8;
+		return 2;
+	case REQ_GET_PORT_COUNT:
+	case REQ_GET_BOARD_ID:
+		if (length < 1)
+			break;
+		if (ioctl(t->fd, request == REQ_GET_BOARD_ID ? SI700X_BOARDID :
+				SI700X_PORT_COUNT, &byte) == -1)
+			return -1;
+		buffer[0] = byte;
+		return 1;
+	}
+	errno = EINVAL;
+	return -1;
+}
+
+/*
+ * The driver stops a read before a response that failed and fails the
+ * next read with it, so a failed read stands for one request.
+ */
+static int chardev_transfer(struct si700x_transport *t,
+		struct transfer_req *reqs, size_t count)
+{
+	size_t base, batch, done;
+	ssize_t length;
+	int error = 0;
+
+	for (base = 0; base < count; base += batch) {
+		batch = count - base;
+		if (batch > MAX_XFER_BATCH)
+			batch = MAX_XFER_BATCH;
+
+		if (write(t->fd, reqs + base, batch * sizeof(*reqs)) !=
+				(ssize_t)(batch * sizeof(*reqs))) {
+			fail_requests(reqs + base, count - base);
+			return -1;
+		}
+
+		for (done = 0; done < batch; ) {
+			length = read(t->fd, reqs + base + done,
+				(batch - done) * sizeof(*reqs));
+			if (length > 0) {
+				done += length / sizeof(*reqs);
+				continue;
+			}
+			/* EFAULT is a response with a failed status */
+			if (length < 0 && errno != EFAULT && !error)
+				error = errno;
+			reqs[base + done].status = XFER_STATUS_NONE;
+			done++;
+		}
+	}
+
+	if (error) {
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+static void chardev_close(struct si700x_transport *t)
+{
+	close(t->fd);
+}
+
+static const struct transport_ops chardev_ops = {
+	.control = chardev_control,
+	.transfer = chardev_transfer,
+	.close = chardev_close,
+};
+
+static struct si700x_transport *chardev_open(const char *path)
+{
+	struct si700x_transport *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->fd = open(path, O_RDWR);
+	if (t->fd < 0) {
+		free(t);
+		return NULL;
+	}
+	t->ops = &chardev_ops;
+	return t;
+}
+
+#ifdef SI700X_LIBUSB
+
+/* libusb backend */
+
+static int usb_errno(int error)
+{
+	switch (error) {
+	case LIBUSB_ERROR_ACCESS:
+		return EACCES;
+	case LIBUSB_ERROR_NO_DEVICE:
+		return ENODEV;
+	case LIBUSB_ERROR_NOT_FOUND:
+		return ENOENT;
+	case LIBUSB_ERROR_BUSY:
+		return EBUSY;
+	case LIBUSB_ERROR_TIMEOUT:
+		return ETIMEDOUT;
+	case LIBUSB_ERROR_PIPE:
+		return EPIPE;
+	case LIBUSB_ERROR_INTERRUPTED:
+		return EINTR;
+	case LIBUSB_ERROR_NO_MEM:
+		return ENOMEM;
+	default:
+		return EIO;
+	}
+}
+
+static int usb_status_errno(enum libusb_transfer_status status)
+{
+	switch (status) {
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return ETIMEDOUT;
+	case LIBUSB_TRANSFER_CANCELLED:
+		return ECANCELED;
+	case LIBUSB_TRANSFER_STALL:
+		return EPIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return ENODEV;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return EOVERFLOW;
+	default:
+		return EIO;
+	}
+}
+
+static void LIBUSB_CALL usb_complete(struct libusb_transfer *transfer)
+{
+	struct usb_packet *packet = transfer->user_data;
+	int error = 0;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		error = usb_status_errno(transfer->status);
+	else if (transfer == packet->in && transfer->actual_length <
+			packet->count * (int)sizeof(struct transfer_req))
+		error = EIO;
+	if (error && !packet->error)
+		packet->error = error;
+
+	/* no response comes for a packet that was not sent */
+	if (transfer == packet->out && packet->error && packet->pending > 1)
+		libusb_cancel_transfer(packet->in);
+	packet->pending--;
+}
+
+/* Put a packet in flight, returns -1 if nothing was submitted */
+static int usb_submit(struct si700x_transport *t, struct usb_packet *packet,
+		struct transfer_req *reqs, int count)
+{
+	int retval;
+
+	packet->reqs = reqs;
+	packet->count = count;
+	packet->error = 0;
+	memcpy(packet->out_buffer, reqs, count * sizeof(*reqs));
+
+	libusb_fill_interrupt_transfer(packet->in, t->handle, PIPE_DATA_IN,
+		(unsigned char *)packet->in_buffer, MAX_PACKET_SIZE,
+		usb_complete, packet, USB_TIMEOUT_MS);
+	libusb_fill_interrupt_transfer(packet->out, t->handle, PIPE_DATA_OUT,
+		(unsigned char *)packet->out_buffer, count * sizeof(*reqs),
+		usb_complete, packet, USB_TIMEOUT_MS);
+
+	retval = libusb_submit_transfer(packet->in);
+	if (retval < 0) {
+		errno = usb_errno(retval);
+		return -1;
+	}
+	packet->pending = 2;
+
+	retval = libusb_submit_transfer(packet->out);
+	if (retval < 0) {
+		/* reaped as a failed packet once the IN transfer is cancelled */
+		packet->error = usb_errno(retval);
+		packet->pending = 1;
+		libusb_cancel_transfer(packet->in);
+	}
+	return 0;
+}
+
+static int usb_transfer(struct si700x_transport *t,
+		struct transfer_req *reqs, size_t count)
+{
+	struct usb_packet *packet;
+	unsigned int head = 0, tail = 0, i;
+	size_t sent = 0;
+	int batch, error = 0;
+
+	while (head != tail || (!error && sent < count)) {
+		/* keep the window full */
+		while (!error && sent < count && head - tail < USB_WINDOW) {
+			batch = count - sent < MAX_XFER_COUNT ?
+				count - sent : MAX_XFER_COUNT;
+			packet = &t->packets[head % USB_WINDOW];
+			if (usb_submit(t, packet, reqs + sent, batch) < 0) {
+				error = errno;
+				break;
+			}
+			sent += batch;
+			head++;
+		}
+		if (head == tail)
+			break;
+
+		/* the oldest packet completes first */
+		packet = &t->packets[tail % USB_WINDOW];
+		while (packet->pending)
+			libusb_handle_events_completed(t->context, NULL);
+		tail++;
+
+		if (packet->error) {
+			fail_requests(packet->reqs, packet->count);
+			if (error)
+				continue;
+			error = packet->error;
+			for (i = tail; i != head; i++) {
+				libusb_cancel_transfer(
+					t->packets[i % USB_WINDOW].out);
+				libusb_cancel_transfer(
+					t->packets[i % USB_WINDOW].in);
+			}
+			continue;
+		}
+		memcpy(packet->reqs, packet->in_buffer,
+			packet->count * sizeof(*reqs));
+	}
+
+	if (error) {
+		fail_requests(reqs + sent, count - sent);
+		errno = error;
+		return -1;
+	}
+	return 0;
+}
+
+static int usb_control(struct si700x_transport *t, uint8_t request,
+		uint8_t request_type, uint16_t value, uint16_t index,
+		void *data, uint16_t length)
+{
+	int retval;
+
+	retval = libusb_control_transfer(t->handle, request_type, request,
+		value, index, data, length, USB_TIMEOUT_MS);
+	if (retval < 0) {
+		errno = usb_errno(retval);
+		return -1;
+	}
+	return retval;
+}
+
+static void usb_close(struct si700x_transport *t)
+{
+	unsigned int i;
+
+	if (t->handle) {
+		libusb_release_interface(t->handle, USB_INTERFACE);
+		libusb_close(t->handle);
+	}
+	for (i = 0; i < USB_WINDOW; i++) {
+		libusb_free_transfer(t->packets[i].out);
+		libusb_free_transfer(t->packets[i].in);
+	}
+	libusb_exit(t->context);
+}
+
+static const struct transport_ops usb_ops = {
+	.control = usb_control,
+	.transfer = usb_transfer,
+	.close = usb_close,
+};
+
+/* Open the index-th board on the buses */
+static int usb_find(struct si700x_transport *t, unsigned int index)
+{
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	ssize_t count, i;
+	int retval = LIBUSB_ERROR_NO_DEVICE;
+
+	count = libusb_get_device_list(t->context, &list);
+	if (count < 0)
+		return count;
+	for (i = 0; i < count; i++) {
+		if (libusb_get_device_descriptor(list[i], &desc) < 0 ||
+				desc.idVendor != USB_VENDOR_ID ||
+				desc.idProduct != USB_PRODUCT_ID)
+			continue;
+		if (index-- == 0) {
+			retval = libusb_open(list[i], &t->handle);
+			break;
+		}
+	}
+	libusb_free_device_list(list, 1);
+	return retval;
+}
+
+static struct si700x_transport *usb_open(unsigned int index)
+{
+	struct si700x_transport *t;
+	unsigned int i;
+	int retval;
+
+	t = calloc(1, sizeof(*t));
+	if (!t)
+		return NULL;
+	t->ops = &usb_ops;
+
+	retval = libusb_init(&t->context);
+	if (retval < 0) {
+		free(t);
+		errno = usb_errno(retval);
+		return NULL;
+	}
+
+	for (i = 0; i < USB_WINDOW; i++) {
+		t->packets[i].out = libusb_alloc_transfer(0);
+		t->packets[i].in = libusb_alloc_transfer(0);
+		if (!t->packets[i].out || !t->packets[i].in) {
+			retval = LIBUSB_ERROR_NO_MEM;
+			goto failed;
+		}
+	}
+
+	retval = usb_find(t, index);
+	if (retval < 0)
+		goto failed;
+
+	/* a loaded driver would own the interface */
+	libusb_set_auto_detach_kernel_driver(t->handle, 1);
+	retval = libusb_claim_interface(t->handle, USB_INTERFACE);
+	if (retval < 0) {
+		libusb_close(t->handle);
+		t->handle = NULL;
+		goto failed;
+	}
+	return t;
+
+failed:
+	usb_close(t);
+	free(t);
+	errno = usb_errno(retval);
+	return NULL;
+}
+
+#endif
+
+struct si700x_transport *si700x_transport_open(const char *name)
+{
+	if (strncmp(name, "usb:", 4) != 0)
+		return chardev_open(name);
+#ifdef SI700X_LIBUSB
+	return usb_open(strtoul(name + 4, NULL, 10));
+#else
+	errno = EPROTONOSUPPORT;
+	return NULL;
+#endif
+}
+
+void si700x_transport_close(struct si700x_transport *t)
+{
+	if (!t)
+		return;
+	t->ops->close(t);
+	free(t);
+}
+
+int si700x_control(struct si700x_transport *t, uint8_t request,
+		uint8_t request_type, uint16_t value, uint16_t index,
+		void *data, uint16_t length)
+{
+	return t->ops->control(t, request, request_type, value, index, data,
+		length);
+}
+
+int si700x_transfer(struct si700x_transport *t, struct transfer_req *reqs,
+		size_t count)
+{
+	return t->ops->transfer(t, reqs, count);
+}
@@ -38,212 +38,2863 @@
 #include <linux/usb.h>
 #include <linux/ioctl.h>
 #include <linux/mutex.h>
+#include <linux/kref.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/delay.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/vmalloc.h>
+#include <linux/pm_runtime.h>
 
 #include "si700x.h"
 
-/* Usb transfer request */
-struct transfer_req {
-	u8 type;
-	u8 status;
+#define XFER_TIMEOUT_MS		1000	/* timeout of a data pipe transfer */
+#define URB_POOL_SIZE		4	/* preallocated data pipe URBs */
+#define SAMPLE_RING_SIZE	64	/* samples kept for subscribers, power of 2 */
+#define SAMPLE_POLL_MS		5	/* status polling interval during conversion */
+#define SAMPLE_TIMEOUT_MS	500	/* maximum conversion time */
+#define SAMPLE_CONV_MS		35	/* typical conversion time */
+#define SAMPLE_XFER_COST	(1 + SAMPLE_CONV_MS / SAMPLE_POLL_MS + 2)
+					/* requests per conversion */
+#define CAPTURE_RING_SIZE	512	/* capture records kept, power of 2 */
+#define SAMPLE_FRAMES		1000	/* packets per second on the data pipes */
+#define SAMPLE_BUS_SHARE	50	/* percent of the packets for sampling */
+#define SCAN_WAKE_DELAY_MS	10000	/* time for the ports to wake up */
+#define WAKE_POLL_MS		10	/* probing interval of waking ports */
+#define TEMPERATURE_MAX_AGE_MS	60000	/* oldest temperature used for humidity */
+
+/* Transfer request queued for the next packets */
+struct si700x_xfer {
+	struct list_head list;		/* entry in a port queue */
+	struct transfer_req req;	/* request, then its response */
+	int priority;			/* XFER_PRIO_* */
+	int state;			/* XFER_IDLE ... XFER_DONE */
+	int result;			/* error code of the packet transfer */
+};
+
+enum {
+	XFER_IDLE,
+	XFER_QUEUED,			/* waiting in a port queue */
+	XFER_ACTIVE,			/* in the packet on the data pipes */
+	XFER_DONE,			/* response or error available */
+};
+
+/* Preallocated URB with its DMA coherent packet buffer */
+struct si700x_urb {
+	struct list_head list;		/* entry in the free list */
+	struct urb *urb;
+	u8 *buffer;			/* MAX_PACKET_SIZE bytes */
+	dma_addr_t dma;
+	struct completion done;
+};
+
+/* The port of a slave is given by the low bits of its address */
+#define xfer_port(address)	((address) & (MAX_SLAVE_COUNT - 1))
+
+/* Slot of dev->slaves in use for subscriptions or prefetching */
+#define slave_active(slave)	((slave)->types || (slave)->prefetch)
+
+/* Request of a client at a free running index */
+#define client_xfer(client, index) \
+	(&(client)->xfers[(index) % MAX_XFER_BATCH])
+
+/* Timestamps of a conversion, ktime_get() in nanoseconds */
+struct si700x_times {
+	u64 start;			/* conversion started */
+	u64 ready;			/* result ready */
+	u64 done;			/* result read */
+};
+
+/* Conversion timing statistics of a port, in microseconds */
+struct si700x_timing_stats {
+	u32 count;
+	u64 conversion_sum;
+	u32 conversion_max;
+	u64 read_sum;
+	u32 read_max;
+	u64 latency_sum;
+	u32 latency_max;
+	u32 latency_last;
+	u32 jitter;			/* smoothed jitter times 16 */
+};
+
+/* Last prefetched result of one type */
+struct si700x_result {
+	int valid;
+	u8 status;			/* XFER_STATUS_* */
+	u16 raw;
+	s32 value;
+	struct si700x_times times;
+	unsigned long time;		/* jiffies the result was read */
+};
+
+/* Conversion stages of a sampled slave */
+enum {
+	STAGE_START,			/* start the conversion */
+	STAGE_POLL,			/* poll the status register */
+	STAGE_READ,			/* read the result */
+};
+
+/* Slave sampled on behalf of the subscribed clients */
+struct si700x_slave {
+	u8 address;
+	u8 types;			/* SAMPLE_* wanted by the subscribers */
+	unsigned int interval;		/* shortest interval requested in ms */
+	unsigned long next;		/* jiffies of the next sample */
+
+	u8 prefetch;			/* SAMPLE_* kept converted */
+	unsigned int max_age;		/* oldest prefetched result in ms */
+	u8 armed;			/* SAMPLE_* to convert for the prefetch */
+	struct si700x_result results[2];	/* temperature, humidity */
+
+	u8 periodic;			/* the period is a subscription one */
+	u8 pending;			/* SAMPLE_* left in the current period */
+	u8 converting;			/* SAMPLE_* being converted, 0 if idle */
+	u8 stage;			/* STAGE_* of the conversion */
+	unsigned long deadline;		/* jiffies the current period ends */
+	unsigned long poll;		/* jiffies of the next status poll */
+	unsigned long timeout;		/* jiffies the conversion times out */
+	struct si700x_times times;	/* of the current conversion */
+
+	int started;			/* last is valid */
+	ktime_t last;			/* end of the last complete period */
+	u32 periods;			/* periods measured since last */
+	u64 period_sum;			/* in us */
+	u64 jitter_sum;			/* in us */
+	u32 jitter_max;			/* in us */
+};
+
+/* Files of the port<N> sysfs groups */
+enum {
+	PORT_ADDRESS,
+	PORT_DEVICE_ID,
+	PORT_TEMPERATURE,
+	PORT_TEMPERATURE_RAW,
+	PORT_TEMPERATURE_TIME,
+	PORT_HUMIDITY,
+	PORT_HUMIDITY_RAW,
+	PORT_HUMIDITY_TIME,
+	PORT_FIELDS,
+};
+
+static const char *port_fields[PORT_FIELDS] = {
+	[PORT_ADDRESS] = "address",
+	[PORT_DEVICE_ID] = "device_id",
+	[PORT_TEMPERATURE] = "temperature",
+	[PORT_TEMPERATURE_RAW] = "temperature_raw",
+	[PORT_TEMPERATURE_TIME] = "temperature_time",
+	[PORT_HUMIDITY] = "humidity",
+	[PORT_HUMIDITY_RAW] = "humidity_raw",
+	[PORT_HUMIDITY_TIME] = "humidity_time",
+};
+
+/* Sysfs attribute of a port, built at probe */
+struct si700x_port_attr {
+	struct device_attribute attr;
+	u8 port;
+	u8 field;			/* PORT_* */
+};
+
+struct si700x_dev {
+	struct usb_device *udev;		/* the usb device */
+	struct usb_interface *interface;	/* the usb interface */
+	struct kref kref;			/* held by probe and the open files */
+	int disconnected;			/* the board is gone */
+	int buffer_size;			/* size of a transfer request */
+	struct mutex lock;			/* serializes packets and control transfers */
+	u8 *ctrl_buffer;			/* DMA buffer of the control requests */
+
+	struct si700x_urb urbs[URB_POOL_SIZE];
+	struct list_head free_urbs;
+	spinlock_t urb_lock;			/* protects free_urbs */
+	struct usb_anchor anchor;		/* submitted URBs */
+	int interval_out;			/* polling interval of the data pipes */
+	int interval_in;
+
+	struct list_head queues[XFER_PRIO_COUNT][MAX_SLAVE_COUNT];
+	int next_port;				/* round robin start of the next packet */
+	spinlock_t queue_lock;			/* protects queues, xfer state and stats */
+	struct si700x_stats stats;
+
+	struct list_head clients;		/* open files */
+	struct si700x_slave slaves[MAX_SLAVE_COUNT];
+	struct mutex slave_lock;		/* protects clients, slaves and caches */
+	struct delayed_work sample_work;
+	struct workqueue_struct *wq;		/* runs the sampler and the scan */
+	struct mutex work_lock;			/* one work of the board at a time */
+	int cpu;				/* CPU of the work, -1 for any */
+
+	s32 temperature[MAX_SLAVE_COUNT];	/* last temperature per port */
+	unsigned long temperature_time[MAX_SLAVE_COUNT];
+	unsigned int temperature_valid;		/* ports with a temperature */
+	struct si700x_timing_stats timing[MAX_SLAVE_COUNT];	/* per port */
+	struct si700x_result cache[MAX_SLAVE_COUNT][2];	/* last reading per port */
+	unsigned int cache_max_age;		/* oldest reading in sysfs in ms */
+
+	struct si700x_slave_list slave_list;	/* slaves found by the scan */
+	u8 port_count;				/* ports of the board, from the scan */
+	struct si700x_port_attr port_attrs[MAX_SLAVE_COUNT][PORT_FIELDS];
+	struct attribute *port_attr_list[MAX_SLAVE_COUNT][PORT_FIELDS + 1];
+	struct attribute_group port_groups[MAX_SLAVE_COUNT];
+	u8 ports_shown;				/* port groups in sysfs */
+	char port_names[MAX_SLAVE_COUNT][8];
+	struct delayed_work scan_work;
+	u8 asleep;				/* ports put to sleep by SETSLEEP_ON */
+	struct delayed_work wake_work;		/* waits for the ports after resume */
+	ktime_t wake_start;			/* resume started */
+
+	struct si700x_sample samples[SAMPLE_RING_SIZE];
+	u32 sample_head;			/* sequence of the next sample */
+	spinlock_t sample_lock;
+	wait_queue_head_t sample_wait;
+
+	u32 prefetch_seq;			/* prefetched results stored */
+	wait_queue_head_t prefetch_wait;
+	int prefetch_pm;			/* PM reference held for the prefetch */
+
+	struct si700x_capture *captures;	/* capture ring, allocated on first use */
+	u32 capture_head;			/* sequence of the next record */
+	unsigned int capture_readers;		/* files in capture mode */
+	spinlock_t capture_lock;		/* protects the capture ring */
+	wait_queue_head_t capture_wait;
+};
+#define to_dev(d) container_of(d, struct si700x_dev, kref)
+
+/* Per open file state */
+struct si700x_client {
+	struct si700x_dev *dev;
+	struct list_head list;			/* entry in si700x_dev.clients */
+	struct si700x_xfer xfers[MAX_XFER_BATCH];	/* written requests */
+	unsigned int xfer_head;			/* next request to write */
+	unsigned int xfer_tail;			/* next response to read */
+	struct mutex xfer_lock;			/* protects the request ring */
+	int priority;				/* XFER_PRIO_* of the next writes */
+	int subscribed;				/* number of subscribed slaves */
+	u8 types[MAX_SLAVE_COUNT];		/* SAMPLE_* subscribed per slave */
+	unsigned int interval[MAX_SLAVE_COUNT];
+	u32 cursor;				/* sequence of the next sample to read */
+	u32 lost;				/* samples overrun since the last read */
+	int capturing;				/* reads return capture records */
+	u32 capture_cursor;			/* sequence of the next record to read */
+	u32 capture_lost;			/* records overrun since the last read */
+};
+
+static struct usb_driver si700x_driver;
+
+static unsigned int autosuspend_delay_ms = 2000;
+module_param(autosuspend_delay_ms, uint, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms,
+	"Idle time before an unused board is suspended (default 2000)");
+
+static unsigned int cache_max_age_ms = 1000;
+module_param(cache_max_age_ms, uint, 0644);
+MODULE_PARM_DESC(cache_max_age_ms,
+	"Oldest reading returned by the port sysfs files (default 1000)");
+
+/* Queue a transfer request, called with queue_lock held */
+static void __si700x_submit(struct si700x_dev *dev, struct si700x_xfer *xfer)
+{
+	xfer->state = XFER_QUEUED;
+	xfer->result = 0;
+	list_add_tail(&xfer->list,
+		&dev->queues[xfer->priority][xfer_port(xfer->req.address)]);
+}
+
+/* Queue a transfer request for the next packets */
+static void si700x_submit(struct si700x_dev *dev, struct si700x_xfer *xfer)
+{
+	spin_lock(&dev->queue_lock);
+	__si700x_submit(dev, xfer);
+	spin_unlock(&dev->queue_lock);
+}
+
+/*
+ * Take the requests of the next packet off the queues. Higher priorities
+ * are served first, and within a priority the ports are taken round robin
+ * one request at a time, so a long queue on one port can't hold back the
+ * others.
+ */
+static int si700x_fill_packet(struct si700x_dev *dev,
+		struct si700x_xfer **xfers)
+{
+	struct si700x_xfer *xfer;
+	struct list_head *queue;
+	int priority, port, index, taken;
+	int count = 0;
+
+	spin_lock(&dev->queue_lock);
+	for (priority = 0; priority < XFER_PRIO_COUNT; priority++) {
+		do {
+			taken = 0;
+			for (index = 0; index < MAX_SLAVE_COUNT; index++) {
+				if (count == MAX_XFER_COUNT)
+					goto out;
+				port = (dev->next_port + index) % MAX_SLAVE_COUNT;
+				queue = &dev->queues[priority][port];
+				if (list_empty(queue))
+					continue;
+				xfer = list_first_entry(queue, struct si700x_xfer, list);
+				list_del_init(&xfer->list);
+				xfer->state = XFER_ACTIVE;
+				xfers[count++] = xfer;
+				taken = 1;
+			}
+		} while (taken);
+	}
+out:
+	dev->next_port = (dev->next_port + 1) % MAX_SLAVE_COUNT;
+	spin_unlock(&dev->queue_lock);
+	return count;
+}
+
+static void si700x_urb_complete(struct urb *urb)
+{
+	struct si700x_urb *u = urb->context;
+
+	complete(&u->done);
+}
+
+static struct si700x_urb *si700x_get_urb(struct si700x_dev *dev)
+{
+	struct si700x_urb *u = NULL;
+
+	spin_lock(&dev->urb_lock);
+	if (!list_empty(&dev->free_urbs)) {
+		u = list_first_entry(&dev->free_urbs, struct si700x_urb, list);
+		list_del_init(&u->list);
+	}
+	spin_unlock(&dev->urb_lock);
+	return u;
+}
+
+static void si700x_put_urb(struct si700x_dev *dev, struct si700x_urb *u)
+{
+	spin_lock(&dev->urb_lock);
+	list_add(&u->list, &dev->free_urbs);
+	spin_unlock(&dev->urb_lock);
+}
+
+/* Submit a pool URB on one of the data pipes */
+static int si700x_submit_urb(struct si700x_dev *dev, struct si700x_urb *u,
+		unsigned int pipe, int length, int interval)
+{
+	int retval;
+
+	usb_fill_int_urb(u->urb, dev->udev, pipe, u->buffer, length,
+		si700x_urb_complete, u, interval);
+	u->urb->transfer_dma = u->dma;
+	u->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	init_completion(&u->done);
+
+	usb_anchor_urb(u->urb, &dev->anchor);
+	retval = usb_submit_urb(u->urb, GFP_KERNEL);
+	if (retval < 0)
+		usb_unanchor_urb(u->urb);
+	return retval;
+}
+
+/* Wait for a submitted pool URB, killing it on timeout */
+static int si700x_wait_urb(struct si700x_urb *u, int *actual_length)
+{
+	if (!wait_for_completion_timeout(&u->done,
+			msecs_to_jiffies(XFER_TIMEOUT_MS))) {
+		usb_kill_urb(u->urb);
+		return -ETIMEDOUT;
+	}
+	*actual_length = u->urb->actual_length;
+	return u->urb->status;
+}
+
+/* Append a record to the capture ring */
+static void si700x_capture(struct si700x_dev *dev,
+		struct si700x_capture *record)
+{
+	spin_lock(&dev->capture_lock);
+	if (!dev->captures) {
+		spin_unlock(&dev->capture_lock);
+		return;
+	}
+	record->time = ktime_to_ns(ktime_get());
+	record->sequence = dev->capture_head;
+	dev->captures[dev->capture_head & (CAPTURE_RING_SIZE - 1)] = *record;
+	dev->capture_head++;
+	spin_unlock(&dev->capture_lock);
+	wake_up_interruptible(&dev->capture_wait);
+}
+
+/* Record the requests or the responses of a packet */
+static void si700x_capture_packet(struct si700x_dev *dev, u8 type,
+		struct si700x_xfer **xfers, int count, int result)
+{
+	struct si700x_capture record;
+	int index;
+
+	if (!ACCESS_ONCE(dev->capture_readers))
+		return;
+	memset(&record, 0x00, sizeof(record));
+	record.type = type;
+	record.count = count;
+	record.result = result;
+	for (index = 0; index < count; index++)
+		record.reqs[index] = xfers[index]->req;
+	si700x_capture(dev, &record);
+}
+
+/*
+ * Send a vendor request on the default control pipe and record it. Called
+ * with the device lock held.
+ */
+static int si700x_control_msg(struct si700x_dev *dev, u8 request,
+		u8 request_type, u16 value, u16 index, void *data, u16 size)
+{
+	struct si700x_capture record;
+	unsigned int pipe;
+	int retval;
+
+	if (request_type & USB_DIR_IN)
+		pipe = usb_rcvctrlpipe(dev->udev, 0);
+	else
+		pipe = usb_sndctrlpipe(dev->udev, 0);
+	retval = usb_control_msg(dev->udev, pipe, request, request_type,
+		value, index, data, size, 0);
+
+	if (!ACCESS_ONCE(dev->capture_readers))
+		return retval;
+	memset(&record, 0x00, sizeof(record));
+	record.type = CAPTURE_CONTROL;
+	record.request = request;
+	record.request_type = request_type;
+	record.value = value;
+	record.index = index;
+	record.length = size;
+	record.result = retval;
+	if (data)
+		memcpy(record.data, data, min_t(u16, size, sizeof(record.data)));
+	si700x_capture(dev, &record);
+	return retval;
+}
+
+/*
+ * Send the next packet of queued requests on the data OUT pipe and read
+ * their responses from the data IN pipe. The IN URB is submitted first so
+ * that it is already waiting when the board answers. Called with the
+ * device lock held. Returns the number of requests completed or a
+ * negative error code.
+ */
+static int si700x_send_packet(struct si700x_dev *dev)
+{
+	struct si700x_xfer *xfers[MAX_XFER_COUNT];
+	struct si700x_urb *out, *in;
+	struct transfer_req *packet;
+	int count, index;
+	int retval = 0;
+	int actual_length = 0;
+
+	/* fail the queued requests at once, the URBs are poisoned */
+	if (ACCESS_ONCE(dev->disconnected)) {
+		count = si700x_fill_packet(dev, xfers);
+		spin_lock(&dev->queue_lock);
+		for (index = 0; index < count; index++) {
+			xfers[index]->result = -ENODEV;
+			xfers[index]->state = XFER_DONE;
+		}
+		spin_unlock(&dev->queue_lock);
+		return -ENODEV;
+	}
+
+	out = si700x_get_urb(dev);
+	in = si700x_get_urb(dev);
+	if (!out || !in) {
+		printk(KERN_ERR "Si700x: URB pool exhausted\n");
+		if (out)
+			si700x_put_urb(dev, out);
+		if (in)
+			si700x_put_urb(dev, in);
+		return -ENOMEM;
+	}
+
+	count = si700x_fill_packet(dev, xfers);
+	if (!count)
+		goto out;
+
+	packet = (struct transfer_req *)out->buffer;
+	for (index = 0; index < count; index++)
+		packet[index] = xfers[index]->req;
+	si700x_capture_packet(dev, CAPTURE_PACKET_OUT, xfers, count, count);
+
+	retval = si700x_submit_urb(dev, in,
+		usb_rcvintpipe(dev->udev, PIPE_DATA_IN),
+		MAX_PACKET_SIZE, dev->interval_in);
+	if (retval < 0) {
+		printk(KERN_ERR "Si700x: failed to submit read URB\n");
+		goto done;
+	}
+
+	retval = si700x_submit_urb(dev, out,
+		usb_sndintpipe(dev->udev, PIPE_DATA_OUT),
+		count * dev->buffer_size, dev->interval_out);
+	if (retval < 0) {
+		printk(KERN_ERR "Si700x: failed to submit write URB\n");
+		usb_kill_urb(in->urb);
+		goto done;
+	}
+
+	retval = si700x_wait_urb(out, &actual_length);
+	if (retval < 0) {
+		printk(KERN_ERR "Si700x: failed to write URB\n");
+		usb_kill_urb(in->urb);
+		goto done;
+	}
+
+	retval = si700x_wait_urb(in, &actual_length);
+	if (retval < 0) {
+		printk(KERN_ERR "Si700x: failed to read URB\n");
+		goto done;
+	}
+	if (actual_length < count * dev->buffer_size) {
+		printk(KERN_ERR "Si700x: short response of %d bytes "
+			"for %d requests\n", actual_length, count);
+		retval = -EIO;
+		goto done;
+	}
+
+	packet = (struct transfer_req *)in->buffer;
+	for (index = 0; index < count; index++)
+		xfers[index]->req = packet[index];
+done:
+	spin_lock(&dev->queue_lock);
+	dev->stats.packets++;
+	if (retval < 0)
+		dev->stats.packet_errors++;
+	for (index = 0; index < count; index++) {
+		xfers[index]->result = retval < 0 ? retval : 0;
+		xfers[index]->state = XFER_DONE;
+		if (retval < 0)
+			continue;
+		dev->stats.requests++;
+		if (xfers[index]->req.status < XFER_STATUS_COUNT)
+			dev->stats.status[xfers[index]->req.status]++;
+		else
+			dev->stats.status_unknown++;
+	}
+	spin_unlock(&dev->queue_lock);
+	si700x_capture_packet(dev, CAPTURE_PACKET_IN, xfers, count,
+		retval < 0 ? retval : count);
+out:
+	si700x_put_urb(dev, in);
+	si700x_put_urb(dev, out);
+	return retval < 0 ? retval : count;
+}
+
+/*
+ * Take the device lock, accounting the time spent waiting for it in the
+ * transfer counters.
+ */
+static void si700x_lock(struct si700x_dev *dev)
+{
+	ktime_t start = ktime_get();
+	u64 wait;
+
+	mutex_lock(&dev->lock);
+	wait = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&dev->queue_lock);
+	dev->stats.lock_acquired++;
+	dev->stats.lock_wait += wait;
+	if (wait > dev->stats.lock_wait_max)
+		dev->stats.lock_wait_max = wait;
+	spin_unlock(&dev->queue_lock);
+}
+
+/*
+ * Wait for a queued request to complete. Whoever holds the device lock
+ * sends packets on behalf of all the waiters, so by the time a waiter gets
+ * the lock its request has often been sent already.
+ */
+static int si700x_wait(struct si700x_dev *dev, struct si700x_xfer *xfer)
+{
+	si700x_lock(dev);
+	while (xfer->state == XFER_QUEUED)
+		si700x_send_packet(dev);
+	mutex_unlock(&dev->lock);
+	return xfer->result;
+}
+
+/* Take a request off the queues, or wait for the packet carrying it */
+static void si700x_cancel(struct si700x_dev *dev, struct si700x_xfer *xfer)
+{
+	int active;
+
+	spin_lock(&dev->queue_lock);
+	if (xfer->state == XFER_QUEUED) {
+		list_del_init(&xfer->list);
+		xfer->state = XFER_IDLE;
+	}
+	active = (xfer->state == XFER_ACTIVE);
+	spin_unlock(&dev->queue_lock);
+
+	if (active) {
+		si700x_lock(dev);
+		mutex_unlock(&dev->lock);
+	}
+}
+
+/*
+ * Send up to MAX_XFER_COUNT transfer requests together and wait for their
+ * responses. Returns the first error of the packet transfers.
+ */
+static int si700x_transfer_batch(struct si700x_dev *dev,
+		struct transfer_req *reqs, int count, int priority)
+{
+	struct si700x_xfer xfers[MAX_XFER_COUNT];
+	int index, result;
+	int retval = 0;
+
+	spin_lock(&dev->queue_lock);
+	for (index = 0; index < count; index++) {
+		xfers[index].req = reqs[index];
+		xfers[index].priority = priority;
+		__si700x_submit(dev, &xfers[index]);
+	}
+	spin_unlock(&dev->queue_lock);
+
+	for (index = 0; index < count; index++) {
+		result = si700x_wait(dev, &xfers[index]);
+		if (result < 0 && !retval)
+			retval = result;
+		reqs[index] = xfers[index].req;
+	}
+	return retval;
+}
+
+/* Send a transfer request and wait for its response */
+static int si700x_transfer(struct si700x_dev *dev, struct transfer_req *req,
+		int priority)
+{
+	return si700x_transfer_batch(dev, req, 1, priority);
+}
+
+static void si700x_free_urbs(struct si700x_dev *dev)
+{
+	struct si700x_urb *u;
+
+	for (u = dev->urbs; u < dev->urbs + URB_POOL_SIZE; u++) {
+		if (u->buffer)
+			usb_free_coherent(dev->udev, MAX_PACKET_SIZE,
+				u->buffer, u->dma);
+		usb_free_urb(u->urb);
+		u->buffer = NULL;
+		u->urb = NULL;
+	}
+}
+
+/*
+ * Allocate the URBs and DMA coherent buffers used by the data pipes, so
+ * that sending a packet needs no allocation or bounce buffer.
+ */
+static int si700x_alloc_urbs(struct si700x_dev *dev)
+{
+	struct si700x_urb *u;
+
+	INIT_LIST_HEAD(&dev->free_urbs);
+	for (u = dev->urbs; u < dev->urbs + URB_POOL_SIZE; u++) {
+		u->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (!u->urb)
+			goto error;
+		u->buffer = usb_alloc_coherent(dev->udev, MAX_PACKET_SIZE,
+			GFP_KERNEL, &u->dma);
+		if (!u->buffer)
+			goto error;
+		list_add_tail(&u->list, &dev->free_urbs);
+	}
+	return 0;
+error:
+	si700x_free_urbs(dev);
+	return -ENOMEM;
+}
+
+/* Free the device once the last file is closed after the disconnect */
+static void si700x_delete(struct kref *kref)
+{
+	struct si700x_dev *dev = to_dev(kref);
+
+	/* a subscription may have armed the sampler after the disconnect */
+	cancel_delayed_work_sync(&dev->sample_work);
+	cancel_delayed_work_sync(&dev->scan_work);
+	cancel_delayed_work_sync(&dev->wake_work);
+	if (dev->wq)
+		destroy_workqueue(dev->wq);
+
+	si700x_free_urbs(dev);
+	vfree(dev->captures);
+	kfree(dev->ctrl_buffer);
+	usb_put_intf(dev->interface);
+	usb_put_dev(dev->udev);
+	kfree(dev);
+}
+
+static int si700x_open(struct inode *i, struct file *f)
+{
+	struct si700x_dev *dev;
+	struct si700x_client *client;
+	struct usb_interface *interface;
+	int minor, retval;
+
+	pr_debug("Si700x: %s\n", __func__);
+
+	minor = iminor(i);
+
+	interface = usb_find_interface(&si700x_driver, minor);
+	if (!interface) {
+		printk(KERN_ERR "Si700x: failed to find interface "
+			"for minor %d", minor);
+		return -ENODEV;
+	}
+
+	dev = usb_get_intfdata(interface);
+	if (!dev || ACCESS_ONCE(dev->disconnected)) {
+		printk(KERN_ERR "Si700x: failed to find device "
+			"for minor %d\n", minor);
+		return -ENODEV;
+	}
+
+	client = kzalloc(sizeof(struct si700x_client), GFP_KERNEL);
+	if (!client) {
+		printk(KERN_ERR "Si700x: failed to allocate memory for client\n");
+		return -ENOMEM;
+	}
+
+	/* the board stays awake while a file is open */
+	retval = usb_autopm_get_interface(interface);
+	if (retval < 0) {
+		printk(KERN_ERR "Si700x: failed to resume the device\n");
+		kfree(client);
+		return retval;
+	}
+	/* the ports of a board that just resumed answer first */
+	flush_delayed_work(&dev->wake_work);
+
+	client->dev = dev;
+	client->priority = XFER_PRIO_NORMAL;
+	mutex_init(&client->xfer_lock);
+	kref_get(&dev->kref);
+
+	mutex_lock(&dev->slave_lock);
+	list_add_tail(&client->list, &dev->clients);
+	mutex_unlock(&dev->slave_lock);
+
+	/* save our object in the file's private structure */
+	f->private_data = client;
+	return 0;
+}
+
+/*
+ * Recalculate the sampling parameters of a slave from the subscriptions
+ * of all the clients. Called with slave_lock held.
+ */
+static void si700x_update_slave(struct si700x_dev *dev, int index)
+{
+	struct si700x_slave *slave = &dev->slaves[index];
+	struct si700x_client *client;
+	unsigned int interval = slave->interval;
+
+	slave->types = 0;
+	slave->interval = 0;
+	list_for_each_entry(client, &dev->clients, list) {
+		if (!client->types[index])
+			continue;
+		slave->types |= client->types[index];
+		if (!slave->interval || client->interval[index] < slave->interval)
+			slave->interval = client->interval[index];
+	}
+
+	/* the achieved rate is measured against the current interval */
+	if (slave->interval != interval) {
+		slave->started = 0;
+		slave->periods = 0;
+		slave->period_sum = 0;
+		slave->jitter_sum = 0;
+		slave->jitter_max = 0;
+	}
+}
+
+/*
+ * Drop the subscribed types of a client for one slave. Called with
+ * slave_lock held.
+ */
+static void si700x_drop_types(struct si700x_client *client, int index, u8 types)
+{
+	if (!client->types[index])
+		return;
+	client->types[index] &= ~types;
+	if (!client->types[index])
+		client->subscribed--;
+	si700x_update_slave(client->dev, index);
+}
+
+static int si700x_release(struct inode *i, struct file *f)
+{
+	struct si700x_dev *dev;
+	struct si700x_client *client;
+	int index;
+
+	pr_debug("Si700x: %s\n", __func__);
+
+	client = (struct si700x_client *)f->private_data;
+	if (client == NULL) {
+		printk(KERN_ERR "Si700x: failed to find device from interface\n");
+		return -ENODEV;
+	}
+	dev = client->dev;
+
+	mutex_lock(&client->xfer_lock);
+	while (client->xfer_tail != client->xfer_head)
+		si700x_cancel(dev, client_xfer(client, client->xfer_tail++));
+	mutex_unlock(&client->xfer_lock);
+
+	if (client->capturing) {
+		spin_lock(&dev->capture_lock);
+		dev->capture_readers--;
+		spin_unlock(&dev->capture_lock);
+	}
+
+	mutex_lock(&dev->slave_lock);
+	for (index = 0; index < MAX_SLAVE_COUNT; index++)
+		si700x_drop_types(client, index, 0xFF);
+	list_del(&client->list);
+	mutex_unlock(&dev->slave_lock);
+
+	mutex_lock(&dev->lock);
+	if (!dev->disconnected)
+		usb_autopm_put_interface(dev->interface);
+	mutex_unlock(&dev->lock);
+
+	f->private_data = NULL;
+	kfree(client);
+	kref_put(&dev->kref, si700x_delete);
+	return 0;
+}
+
+static void si700x_fill_req(struct transfer_req *req, u8 type, u8 address,
+		u8 length, u8 reg, u8 value)
+{
+	memset(req, 0x00, sizeof(*req));
+	req->type = type;
+	req->address = address;
+	req->length = length;
+	req->data[0] = reg;
+	req->data[1] = value;
+}
+
+/*
+ * Wait for woken up ports to answer, probing both slave addresses of
+ * every port with a read of the device ID register until one of them
+ * acknowledges. The wake up time of a port isn't known in advance, so
+ * this replaces a fixed delay. Returns 0 once all the ports answered.
+ */
+static int si700x_wait_ports(struct si700x_dev *dev, unsigned int ports)
+{
+	static const u8 bases[] = { SLAVE_NEW, SLAVE_LEGACY };
+	struct si700x_xfer xfers[2 * MAX_SLAVE_COUNT];
+	unsigned long timeout = jiffies + msecs_to_jiffies(SCAN_WAKE_DELAY_MS);
+	int port, base, index, count;
+
+	while (ports) {
+		count = 0;
+		spin_lock(&dev->queue_lock);
+		for (port = 0; port < MAX_SLAVE_COUNT; port++) {
+			if (!(ports & (1 << port)))
+				continue;
+			for (base = 0; base < ARRAY_SIZE(bases); base++) {
+				si700x_fill_req(&xfers[count].req,
+					XFER_TYPE_WRITE_READ, bases[base] + port,
+					1, REG_DEVICE_ID, 0x00);
+				xfers[count].priority = XFER_PRIO_REALTIME;
+				__si700x_submit(dev, &xfers[count++]);
+			}
+		}
+		spin_unlock(&dev->queue_lock);
+
+		for (index = 0; index < count; index++) {
+			if (si700x_wait(dev, &xfers[index]) == -ENODEV)
+				return -ENODEV;
+			if (xfers[index].result == 0 &&
+					xfers[index].req.status == XFER_STATUS_SUCCESS)
+				ports &= ~(1 << xfer_port(xfers[index].req.address));
+		}
+
+		if (!ports)
+			break;
+		if (time_after(jiffies, timeout))
+			return -ETIMEDOUT;
+		msleep(WAKE_POLL_MS);
+		if (ACCESS_ONCE(dev->disconnected))
+			return -ENODEV;
+	}
+	return 0;
+}
+
+/* Account a wake up of the ports that started at start */
+static void si700x_account_resume(struct si700x_dev *dev, ktime_t start)
+{
+	u64 latency = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	spin_lock(&dev->queue_lock);
+	dev->stats.resumes++;
+	dev->stats.resume_latency += latency;
+	if (latency > dev->stats.resume_latency_max)
+		dev->stats.resume_latency_max = latency;
+	spin_unlock(&dev->queue_lock);
+}
+
+/* Ports on which the last scan found slaves */
+static unsigned int si700x_slave_ports(struct si700x_dev *dev)
+{
+	unsigned int ports = 0;
+	int index;
+
+	mutex_lock(&dev->slave_lock);
+	for (index = 0; index < dev->slave_list.count; index++)
+		ports |= 1 << dev->slave_list.slaves[index].port;
+	mutex_unlock(&dev->slave_lock);
+	return ports;
+}
+
+/*
+ * Read one register of a slave. Returns 0 on success, a negative error
+ * code if the USB transfer failed or the XFER_STATUS_* of the failed
+ * slave transfer.
+ */
+static int si700x_read_reg(struct si700x_dev *dev, u8 address, u8 reg,
+		u8 length, u8 *value, int priority)
+{
+	struct transfer_req req;
+	int retval;
+
+	si700x_fill_req(&req, XFER_TYPE_WRITE_READ, address, length, reg, 0x00);
+	retval = si700x_transfer(dev, &req, priority);
+	if (retval < 0)
+		return retval;
+	if (req.status != XFER_STATUS_SUCCESS)
+		return req.status;
+	memcpy(value, req.data, length);
+	return 0;
+}
+
+/*
+ * Account the timestamps of a successful conversion to the statistics of
+ * its port. Called with slave_lock held.
+ */
+static void si700x_account_timing(struct si700x_dev *dev, u8 address,
+		struct si700x_times *times)
+{
+	struct si700x_timing_stats *t = &dev->timing[xfer_port(address)];
+	u32 conversion, read, latency, delta;
+
+	conversion = div_u64(times->ready - times->start, NSEC_PER_USEC);
+	read = div_u64(times->done - times->ready, NSEC_PER_USEC);
+	latency = conversion + read;
+
+	t->conversion_sum += conversion;
+	t->conversion_max = max(t->conversion_max, conversion);
+	t->read_sum += read;
+	t->read_max = max(t->read_max, read);
+	t->latency_sum += latency;
+	t->latency_max = max(t->latency_max, latency);
+
+	/* J += (|D| - J) / 16, kept times 16 */
+	if (t->count) {
+		delta = latency > t->latency_last ? latency - t->latency_last :
+			t->latency_last - latency;
+		t->jitter += delta - ((t->jitter + 8) >> 4);
+	}
+	t->latency_last = latency;
+	t->count++;
+}
+
+/*
+ * Run one temperature or humidity conversion on a slave and return its
+ * raw result and the timestamps of the conversion, which are added to
+ * the timing statistics of the port. Return values are as for
+ * si700x_read_reg().
+ */
+static int si700x_measure(struct si700x_dev *dev, u8 address, u8 type,
+		u16 *raw, struct si700x_times *times, int priority)
+{
+	struct transfer_req req;
+	unsigned long timeout;
+	u8 config = CFG1_START_CONV;
+	u8 status, data[2];
+	int retval;
+
+	if (type == SAMPLE_TEMPERATURE)
+		config |= CFG1_TEMPERATURE;
+	memset(times, 0x00, sizeof(*times));
+
+	/* start the conversion */
+	si700x_fill_req(&req, XFER_TYPE_WRITE, address, 2, REG_CFG1, config);
+	retval = si700x_transfer(dev, &req, priority);
+	if (retval < 0)
+		return retval;
+	if (req.status != XFER_STATUS_SUCCESS)
+		return req.status;
+	times->start = ktime_to_ns(ktime_get());
+
+	/* wait for the conversion to complete */
+	timeout = jiffies + msecs_to_jiffies(SAMPLE_TIMEOUT_MS);
+	do {
+		if (time_after(jiffies, timeout))
+			return XFER_STATUS_TIMEOUT;
+		msleep(SAMPLE_POLL_MS);
+		retval = si700x_read_reg(dev, address, REG_STATUS, 1, &status,
+			priority);
+		if (retval)
+			return retval;
+	} while (status & STATUS_NOT_READY);
+	times->ready = ktime_to_ns(ktime_get());
+
+	/* DATAh and DATAl in one read */
+	retval = si700x_read_reg(dev, address, REG_DATA, 2, data, priority);
+	if (retval)
+		return retval;
+	times->done = ktime_to_ns(ktime_get());
+
+	mutex_lock(&dev->slave_lock);
+	si700x_account_timing(dev, address, times);
+	mutex_unlock(&dev->slave_lock);
+
+	if (type == SAMPLE_TEMPERATURE)
+		*raw = TEMPERATURE_RAW(data[0], data[1]);
+	else
+		*raw = HUMIDITY_RAW(data[0], data[1]);
+	return 0;
+}
+
+/*
+ * Keep the last good reading of a port for the sysfs files. done is the
+ * time the result was read, 0 for now. Called with slave_lock held.
+ */
+static void si700x_cache(struct si700x_dev *dev, u8 address, u8 type,
+		u16 raw, s32 value, u64 done)
+{
+	struct si700x_result *result;
+
+	result = &dev->cache[xfer_port(address)][type == SAMPLE_HUMIDITY];
+	result->valid = 1;
+	result->status = XFER_STATUS_SUCCESS;
+	result->raw = raw;
+	result->value = value;
+	memset(&result->times, 0x00, sizeof(result->times));
+	result->times.done = done ? done : ktime_to_ns(ktime_get());
+	result->time = jiffies;
+}
+
+/*
+ * Get the last temperature of a port if it is recent enough to compensate
+ * the humidity. Returns 1 if it is. Called with slave_lock held.
+ */
+static int si700x_port_temperature(struct si700x_dev *dev, int port,
+		s32 *temperature)
+{
+	if (!(dev->temperature_valid & (1 << port)) ||
+			time_after_eq(jiffies, dev->temperature_time[port] +
+			msecs_to_jiffies(TEMPERATURE_MAX_AGE_MS)))
+		return 0;
+	*temperature = dev->temperature[port];
+	return 1;
+}
+
+/*
+ * Convert a raw result to milli-degree Celsius or milli-percent. The
+ * humidity is compensated with the last temperature of the slave port,
+ * which is measured first if it is older than TEMPERATURE_MAX_AGE_MS.
+ */
+static int si700x_convert(struct si700x_dev *dev, u8 address, u8 type,
+		u16 raw, s32 *value, int priority)
+{
+	int port = xfer_port(address);
+	struct si700x_times times;
+	u16 temperature_raw;
+	s32 temperature;
+	int retval, valid;
+
+	if (type == SAMPLE_TEMPERATURE) {
+		*value = TEMPERATURE_MILLI(raw);
+		mutex_lock(&dev->slave_lock);
+		dev->temperature[port] = *value;
+		dev->temperature_time[port] = jiffies;
+		dev->temperature_valid |= 1 << port;
+		si700x_cache(dev, address, type, raw, *value, 0);
+		mutex_unlock(&dev->slave_lock);
+		return 0;
+	}
+
+	mutex_lock(&dev->slave_lock);
+	valid = si700x_port_temperature(dev, port, &temperature);
+	mutex_unlock(&dev->slave_lock);
+
+	if (!valid) {
+		retval = si700x_measure(dev, address, SAMPLE_TEMPERATURE,
+			&temperature_raw, &times, priority);
+		if (retval)
+			return retval;
+		si700x_convert(dev, address, SAMPLE_TEMPERATURE,
+			temperature_raw, &temperature, priority);
+	}
+
+	*value = HUMIDITY_CLAMP(HUMIDITY_COMPENSATE(
+		HUMIDITY_LINEAR(HUMIDITY_MILLI(raw)), temperature));
+	mutex_lock(&dev->slave_lock);
+	si700x_cache(dev, address, type, raw, *value, 0);
+	mutex_unlock(&dev->slave_lock);
+	return 0;
+}
+
+/*
+ * Measure a slave and convert the result. Return values are as for
+ * si700x_read_reg().
+ */
+static int si700x_read_value(struct si700x_dev *dev, u8 address, u8 type,
+		u16 *raw, s32 *value, struct si700x_times *times, int priority)
+{
+	int retval;
+
+	retval = si700x_measure(dev, address, type, raw, times, priority);
+	if (retval)
+		return retval;
+	return si700x_convert(dev, address, type, *raw, value, priority);
+}
+
+/* Map the return value of si700x_read_reg() to a transfer status */
+static u8 si700x_status(int retval)
+{
+	if (retval == 0)
+		return XFER_STATUS_SUCCESS;
+	if (retval > 0)
+		return retval;
+	return XFER_STATUS_NONE;
+}
+
+/*
+ * Run one conversion on several slaves together, the requests of every
+ * stage going in the same packets. statuses gets the XFER_STATUS_* of each
+ * slave and start the time the conversions were started. Returns 0 or a
+ * negative error code if the packets failed.
+ */
+static int si700x_convert_all(struct si700x_dev *dev, const u8 *addresses,
+		int count, u8 type, u16 *raws, u8 *statuses,
+		struct si700x_times *times, u64 *start, int priority)
+{
+	struct transfer_req reqs[MAX_XFER_COUNT];
+	unsigned long timeout;
+	unsigned int waiting = 0, ready = 0;
+	int index[MAX_XFER_COUNT];
+	int i, n, retval;
+	u8 config = CFG1_START_CONV;
+	u64 now;
+
+	if (type == SAMPLE_TEMPERATURE)
+		config |= CFG1_TEMPERATURE;
+	memset(times, 0x00, count * sizeof(*times));
+
+	/* start them all in one packet */
+	for (i = 0; i < count; i++)
+		si700x_fill_req(&reqs[i], XFER_TYPE_WRITE, addresses[i], 2,
+			REG_CFG1, config);
+	retval = si700x_transfer_batch(dev, reqs, count, priority);
+	if (retval < 0)
+		return retval;
+	now = ktime_to_ns(ktime_get());
+	*start = now;
+	for (i = 0; i < count; i++) {
+		statuses[i] = reqs[i].status;
+		if (statuses[i] != XFER_STATUS_SUCCESS)
+			continue;
+		times[i].start = now;
+		waiting |= 1 << i;
+	}
+
+	/* poll the status registers of the slaves still converting */
+	timeout = jiffies + msecs_to_jiffies(SAMPLE_TIMEOUT_MS);
+	while (waiting) {
+		if (time_after(jiffies, timeout)) {
+			for (i = 0; i < count; i++)
+				if (waiting & (1 << i))
+					statuses[i] = XFER_STATUS_TIMEOUT;
+			break;
+		}
+		msleep(SAMPLE_POLL_MS);
+
+		for (i = 0, n = 0; i < count; i++) {
+			if (!(waiting & (1 << i)))
+				continue;
+			si700x_fill_req(&reqs[n], XFER_TYPE_WRITE_READ,
+				addresses[i], 1, REG_STATUS, 0x00);
+			index[n++] = i;
+		}
+		retval = si700x_transfer_batch(dev, reqs, n, priority);
+		if (retval < 0)
+			return retval;
+		now = ktime_to_ns(ktime_get());
+		for (n--; n >= 0; n--) {
+			i = index[n];
+			if (reqs[n].status != XFER_STATUS_SUCCESS) {
+				statuses[i] = reqs[n].status;
+				waiting &= ~(1 << i);
+			} else if (!(reqs[n].data[0] & STATUS_NOT_READY)) {
+				times[i].ready = now;
+				waiting &= ~(1 << i);
+				ready |= 1 << i;
+			}
+		}
+	}
+	if (!ready)
+		return 0;
+
+	/* read the results, DATAh and DATAl in one request per slave */
+	for (i = 0, n = 0; i < count; i++) {
+		if (!(ready & (1 << i)))
+			continue;
+		si700x_fill_req(&reqs[n], XFER_TYPE_WRITE_READ,
+			addresses[i], 2, REG_DATA, 0x00);
+		index[n++] = i;
+	}
+	retval = si700x_transfer_batch(dev, reqs, n, priority);
+	if (retval < 0)
+		return retval;
+	now = ktime_to_ns(ktime_get());
+	for (n--; n >= 0; n--) {
+		i = index[n];
+		statuses[i] = reqs[n].status;
+		if (statuses[i] != XFER_STATUS_SUCCESS)
+			continue;
+		times[i].done = now;
+		if (type == SAMPLE_TEMPERATURE)
+			raws[i] = TEMPERATURE_RAW(reqs[n].data[0],
+				reqs[n].data[1]);
+		else
+			raws[i] = HUMIDITY_RAW(reqs[n].data[0],
+				reqs[n].data[1]);
+	}
+
+	mutex_lock(&dev->slave_lock);
+	for (i = 0; i < count; i++)
+		if (statuses[i] == XFER_STATUS_SUCCESS)
+			si700x_account_timing(dev, addresses[i], &times[i]);
+	mutex_unlock(&dev->slave_lock);
+	return 0;
+}
+
+/* Add a sample to the ring and wake up the subscribed readers */
+static void si700x_publish(struct si700x_dev *dev, struct si700x_sample *sample)
+{
+	spin_lock(&dev->sample_lock);
+	sample->sequence = dev->sample_head;
+	dev->samples[dev->sample_head & (SAMPLE_RING_SIZE - 1)] = *sample;
+	dev->sample_head++;
+	spin_unlock(&dev->sample_lock);
+
+	wake_up_interruptible(&dev->sample_wait);
+}
+
+/*
+ * Sampler request, one conversion stage of a slave. The requests of all
+ * the slaves are sent in one packet, earliest deadline first.
+ */
+struct si700x_sample_req {
+	int index;			/* slave slot */
 	u8 address;
-	u8 length;
-	u8 data[4];
-} __attribute__ ((__packed__));
+	u8 type;			/* SAMPLE_* being converted */
+	u8 stage;			/* STAGE_* */
+	unsigned long deadline;
+	int first;			/* first transfer request in the packet */
+};
+
+/*
+ * Total transfer requests per 1000 seconds needed by the sampled slaves.
+ * Called with slave_lock held.
+ */
+static u32 si700x_bus_demand(struct si700x_dev *dev)
+{
+	struct si700x_slave *slave;
+	u32 demand = 0;
+
+	for (slave = dev->slaves; slave < dev->slaves + MAX_SLAVE_COUNT; slave++) {
+		if (slave->types)
+			demand += hweight8(slave->types) * SAMPLE_XFER_COST *
+				1000000 / slave->interval;
+		/* a prefetching reader may keep converting back to back */
+		if (slave->prefetch)
+			demand += SAMPLE_XFER_COST * 1000000 / SAMPLE_CONV_MS;
+	}
+	return demand;
+}
+
+/*
+ * Check that the sampled slaves fit on the bus : every slave must have time
+ * for its conversions within its interval, and all the conversions together
+ * must fit in the sampling share of the data pipe packets. Called with
+ * slave_lock held.
+ */
+static int si700x_admit(struct si700x_dev *dev)
+{
+	struct si700x_slave *slave;
+
+	for (slave = dev->slaves; slave < dev->slaves + MAX_SLAVE_COUNT; slave++)
+		if (slave->types && hweight8(slave->types) * SAMPLE_CONV_MS >
+				slave->interval)
+			return -EINVAL;
+
+	if (si700x_bus_demand(dev) > SAMPLE_FRAMES * MAX_XFER_COUNT *
+			SAMPLE_BUS_SHARE / 100 * 1000)
+		return -EBUSY;
+	return 0;
+}
+
+/*
+ * Finish the current conversion of a slave, publish its sample if it was
+ * subscribed and move on to the next type of the period. Called with
+ * slave_lock held.
+ */
+static void si700x_sample_done(struct si700x_dev *dev,
+		struct si700x_slave *slave, u8 status, u16 raw)
+{
+	struct si700x_sample sample;
+	struct si700x_result *result;
+	int port = xfer_port(slave->address);
+	s32 temperature = 30000;
+	s64 period, jitter;
+	ktime_t now;
+
+	memset(&sample, 0x00, sizeof(sample));
+	sample.address = slave->address;
+	sample.type = slave->converting;
+	sample.status = status;
+	sample.raw = raw;
+	sample.start = slave->times.start;
+	sample.ready = slave->times.ready;
+	sample.done = slave->times.done;
+	if (status == XFER_STATUS_SUCCESS)
+		si700x_account_timing(dev, slave->address, &slave->times);
+	memset(&slave->times, 0x00, sizeof(slave->times));
+
+	if (status == XFER_STATUS_SUCCESS &&
+			slave->converting == SAMPLE_TEMPERATURE) {
+		sample.value = TEMPERATURE_MILLI(raw);
+		dev->temperature[port] = sample.value;
+		dev->temperature_time[port] = jiffies;
+		dev->temperature_valid |= 1 << port;
+	} else if (status == XFER_STATUS_SUCCESS) {
+		/* the period converted the temperature first if it was stale */
+		if (dev->temperature_valid & (1 << port))
+			temperature = dev->temperature[port];
+		sample.value = HUMIDITY_CLAMP(HUMIDITY_COMPENSATE(
+			HUMIDITY_LINEAR(HUMIDITY_MILLI(raw)), temperature));
+	}
+	if (status == XFER_STATUS_SUCCESS)
+		si700x_cache(dev, slave->address, slave->converting, raw,
+			sample.value, sample.done);
+	if (slave->types & slave->converting)
+		si700x_publish(dev, &sample);
+	if (slave->prefetch & slave->converting) {
+		result = &slave->results[slave->converting == SAMPLE_HUMIDITY];
+		result->valid = 1;
+		result->status = status;
+		result->raw = raw;
+		result->value = sample.value;
+		result->times.start = sample.start;
+		result->times.ready = sample.ready;
+		result->times.done = sample.done;
+		result->time = jiffies;
+		dev->prefetch_seq++;
+		wake_up_interruptible(&dev->prefetch_wait);
+	}
+
+	slave->pending &= ~slave->converting;
+	if (slave->pending) {
+		slave->converting = (slave->pending & SAMPLE_TEMPERATURE) ?
+			SAMPLE_TEMPERATURE : SAMPLE_HUMIDITY;
+		slave->stage = STAGE_START;
+		return;
+	}
+	slave->converting = 0;
+	if (!slave->periodic)
+		return;
+
+	/* end of the period, account for the achieved rate */
+	now = ktime_get();
+	if (slave->started) {
+		period = ktime_to_us(ktime_sub(now, slave->last));
+		jitter = period - (s64)slave->interval * 1000;
+		if (jitter < 0)
+			jitter = -jitter;
+		slave->periods++;
+		slave->period_sum += period;
+		slave->jitter_sum += jitter;
+		if (jitter > slave->jitter_max)
+			slave->jitter_max = jitter;
+	}
+	slave->last = now;
+	slave->started = 1;
+}
+
+/*
+ * Collect the conversion stages due now, earliest deadline first. Starts a
+ * new period on the slaves whose release time has come. Called with
+ * slave_lock held, returns the number of requests.
+ */
+static int si700x_sample_due(struct si700x_dev *dev,
+		struct si700x_sample_req *reqs)
+{
+	struct si700x_slave *slave;
+	struct si700x_sample_req req;
+	unsigned long interval;
+	int index, count = 0, pos;
+	int port;
+
+	for (index = 0; index < MAX_SLAVE_COUNT; index++) {
+		slave = &dev->slaves[index];
+		if (!slave_active(slave))
+			continue;
+
+		if (!slave->converting) {
+			if (slave->types && !time_before(jiffies, slave->next)) {
+				interval = msecs_to_jiffies(slave->interval);
+				slave->deadline = slave->next + interval;
+				/* don't try to catch up on missed periods */
+				if (time_before(slave->deadline, jiffies))
+					slave->deadline = jiffies + interval;
+				slave->next = slave->deadline;
+				slave->pending = slave->types | slave->armed;
+				slave->periodic = 1;
+			} else if (slave->armed) {
+				/* the result is wanted before the last one expires */
+				slave->deadline = jiffies +
+					msecs_to_jiffies(slave->max_age);
+				slave->pending = slave->armed;
+				slave->periodic = 0;
+			} else {
+				continue;
+			}
+			slave->armed = 0;
+
+			port = xfer_port(slave->address);
+			if ((slave->pending & SAMPLE_HUMIDITY) &&
+					(!(dev->temperature_valid & (1 << port)) ||
+					time_after(jiffies,
+					dev->temperature_time[port] +
+					msecs_to_jiffies(TEMPERATURE_MAX_AGE_MS))))
+				slave->pending |= SAMPLE_TEMPERATURE;
+			slave->converting = (slave->pending & SAMPLE_TEMPERATURE) ?
+				SAMPLE_TEMPERATURE : SAMPLE_HUMIDITY;
+			slave->stage = STAGE_START;
+		} else if (slave->stage == STAGE_POLL &&
+				time_before(jiffies, slave->poll)) {
+			continue;
+		}
+
+		req.index = index;
+		req.address = slave->address;
+		req.type = slave->converting;
+		req.stage = slave->stage;
+		req.deadline = slave->deadline;
+
+		/* insertion sort on the deadline */
+		for (pos = count; pos > 0 &&
+				time_before(req.deadline, reqs[pos - 1].deadline);
+				pos--)
+			reqs[pos] = reqs[pos - 1];
+		reqs[pos] = req;
+		count++;
+	}
+	return count;
+}
+
+/* Time until the sampler has something to do */
+static long si700x_sample_delay(struct si700x_dev *dev)
+{
+	struct si700x_slave *slave;
+	unsigned long next = 0, due;
+	int active = 0;
+
+	for (slave = dev->slaves; slave < dev->slaves + MAX_SLAVE_COUNT; slave++) {
+		if (!slave_active(slave))
+			continue;
+		if (slave->converting && slave->stage == STAGE_POLL)
+			due = slave->poll;
+		else if (slave->converting || slave->armed)
+			due = jiffies;
+		else if (slave->types)
+			due = slave->next;
+		else
+			continue;
+		if (!active || time_before(due, next))
+			next = due;
+		active = 1;
+	}
+
+	if (!active)
+		return -1;
+	if (time_before(next, jiffies))
+		return 0;
+	return next - jiffies;
+}
+
+/* Queue work of the device on its workqueue and CPU */
+static void si700x_queue_work(struct si700x_dev *dev,
+		struct delayed_work *work, unsigned long delay)
+{
+	int cpu = ACCESS_ONCE(dev->cpu);
+
+	/* nothing is started once the board is gone */
+	if (ACCESS_ONCE(dev->disconnected))
+		return;
+	if (cpu >= 0 && cpu_online(cpu))
+		queue_delayed_work_on(cpu, dev->wq, work, delay);
+	else
+		queue_delayed_work(dev->wq, work, delay);
+}
+
+/* Arm the sampler for the earliest due slave */
+static void si700x_schedule_sampler(struct si700x_dev *dev)
+{
+	long delay;
+
+	mutex_lock(&dev->slave_lock);
+	delay = si700x_sample_delay(dev);
+	mutex_unlock(&dev->slave_lock);
+
+	if (delay >= 0)
+		si700x_queue_work(dev, &dev->sample_work, delay);
+}
+
+/*
+ * Sampler, a state machine running the conversions of all the subscribed
+ * slaves at once. Every run sends one packet, that is one frame of the
+ * data pipes, with the due conversion stages in earliest deadline order.
+ * Stages that don't fit are sent by the next run right away.
+ */
+static void si700x_sample_work(struct work_struct *work)
+{
+	struct si700x_dev *dev = container_of(work, struct si700x_dev,
+			sample_work.work);
+	struct si700x_sample_req due[MAX_SLAVE_COUNT];
+	struct transfer_req reqs[MAX_XFER_COUNT];
+	struct si700x_slave *slave;
+	struct si700x_sample_req *r;
+	int count, sent = 0, xfers = 0;
+	int retval;
+	u8 config, status;
+	u64 now;
+
+	pr_debug("Si700x: %s\n", __func__);
+
+	mutex_lock(&dev->work_lock);
+	mutex_lock(&dev->slave_lock);
+	count = si700x_sample_due(dev, due);
+	mutex_unlock(&dev->slave_lock);
+
+	for (r = due; r < due + count; r++) {
+		if (xfers == MAX_XFER_COUNT)
+			break;
+		r->first = xfers;
+		switch (r->stage) {
+		case STAGE_START:
+			config = CFG1_START_CONV;
+			if (r->type == SAMPLE_TEMPERATURE)
+				config |= CFG1_TEMPERATURE;
+			si700x_fill_req(&reqs[xfers++], XFER_TYPE_WRITE,
+				r->address, 2, REG_CFG1, config);
+			break;
+		case STAGE_POLL:
+			si700x_fill_req(&reqs[xfers++], XFER_TYPE_WRITE_READ,
+				r->address, 1, REG_STATUS, 0x00);
+			break;
+		case STAGE_READ:
+			si700x_fill_req(&reqs[xfers++], XFER_TYPE_WRITE_READ,
+				r->address, 2, REG_DATA, 0x00);
+			break;
+		}
+		sent++;
+	}
+	if (!sent)
+		goto out;
+
+	retval = si700x_transfer_batch(dev, reqs, xfers, XFER_PRIO_REALTIME);
+	now = ktime_to_ns(ktime_get());
+
+	mutex_lock(&dev->slave_lock);
+	for (r = due; r < due + sent; r++) {
+		slave = &dev->slaves[r->index];
+		/* unsubscribed or reused while the packet was out */
+		if (!slave_active(slave) || slave->address != r->address ||
+				slave->converting != r->type ||
+				slave->stage != r->stage)
+			continue;
+
+		status = retval < 0 ? XFER_STATUS_NONE : reqs[r->first].status;
+		if (status != XFER_STATUS_SUCCESS) {
+			si700x_sample_done(dev, slave, status, 0);
+			continue;
+		}
+
+		switch (r->stage) {
+		case STAGE_START:
+			slave->times.start = now;
+			slave->stage = STAGE_POLL;
+			slave->poll = jiffies + msecs_to_jiffies(SAMPLE_POLL_MS);
+			slave->timeout = jiffies +
+				msecs_to_jiffies(SAMPLE_TIMEOUT_MS);
+			break;
+		case STAGE_POLL:
+			if (!(reqs[r->first].data[0] & STATUS_NOT_READY)) {
+				slave->times.ready = now;
+				slave->stage = STAGE_READ;
+			} else if (time_after(jiffies, slave->timeout)) {
+				si700x_sample_done(dev, slave,
+					XFER_STATUS_TIMEOUT, 0);
+			} else {
+				slave->poll = jiffies +
+					msecs_to_jiffies(SAMPLE_POLL_MS);
+			}
+			break;
+		case STAGE_READ:
+			slave->times.done = now;
+			if (r->type == SAMPLE_TEMPERATURE)
+				si700x_sample_done(dev, slave,
+					XFER_STATUS_SUCCESS, TEMPERATURE_RAW(
+					reqs[r->first].data[0],
+					reqs[r->first].data[1]));
+			else
+				si700x_sample_done(dev, slave,
+					XFER_STATUS_SUCCESS, HUMIDITY_RAW(
+					reqs[r->first].data[0],
+					reqs[r->first].data[1]));
+			break;
+		}
+	}
+	mutex_unlock(&dev->slave_lock);
+
+out:
+	mutex_unlock(&dev->work_lock);
+	si700x_schedule_sampler(dev);
+}
+
+/*
+ * Add the port groups of the slaves found by the scan and remove the
+ * others. Only the scan and disconnect change them.
+ */
+static void si700x_update_ports(struct si700x_dev *dev)
+{
+	unsigned int ports = si700x_slave_ports(dev);
+	int port;
+
+	for (port = 0; port < MAX_SLAVE_COUNT; port++) {
+		if (!(ports & (1 << port)) == !(dev->ports_shown & (1 << port)))
+			continue;
+		if (!(ports & (1 << port))) {
+			sysfs_remove_group(&dev->interface->dev.kobj,
+				&dev->port_groups[port]);
+			dev->ports_shown &= ~(1 << port);
+			continue;
+		}
+		if (sysfs_create_group(&dev->interface->dev.kobj,
+				&dev->port_groups[port])) {
+			printk(KERN_ERR "Si700x: failed to create sysfs "
+				"attributes of port %d\n", port);
+			continue;
+		}
+		dev->ports_shown |= 1 << port;
+	}
+}
+
+/*
+ * Scan the ports for responding slaves and read their device ID. Every
+ * candidate address is probed in the same packets.
+ */
+static void si700x_scan_work(struct work_struct *work)
+{
+	struct si700x_dev *dev = container_of(work, struct si700x_dev,
+			scan_work.work);
+	static const u8 bases[] = { SLAVE_NEW, SLAVE_LEGACY };
+	struct transfer_req reqs[2 * MAX_SLAVE_COUNT];
+	struct si700x_slave_list list;
+	u8 *port_count;
+	int port, base, index, batch;
+	int count = 0;
+	int retval;
+
+	pr_debug("Si700x: %s\n", __func__);
+
+	port_count = kmalloc(1, GFP_KERNEL);
+	if (!port_count)
+		return;
+	if (usb_autopm_get_interface(dev->interface) < 0) {
+		kfree(port_count);
+		return;
+	}
+	mutex_lock(&dev->work_lock);
+	si700x_lock(dev);
+	retval = si700x_control_msg(dev,
+		REQ_GET_PORT_COUNT, CMD_VEN_DEV_IN,
+		0, 0,			/* value, index */
+		port_count, 1);		/* data, size */
+	mutex_unlock(&dev->lock);
+	if (retval < 0) {
+		printk(KERN_ERR "Si700x: failed to read port count\n");
+		kfree(port_count);
+		goto out;
+	}
+	/* the ports are told apart by the low bits of the address */
+	if (*port_count > MAX_SLAVE_COUNT)
+		*port_count = MAX_SLAVE_COUNT;
+	mutex_lock(&dev->slave_lock);
+	dev->port_count = *port_count;
+	mutex_unlock(&dev->slave_lock);
+
+	/* probe every address like a write of the config register */
+	for (port = 0; port < *port_count; port++)
+		for (base = 0; base < ARRAY_SIZE(bases); base++)
+			si700x_fill_req(&reqs[count++], XFER_TYPE_WRITE,
+				bases[base] + port, 0, REG_CFG1, 0x00);
+	kfree(port_count);
+
+	/* a batch is at most one packet */
+	for (index = 0; index < count; index += batch) {
+		batch = min(count - index, MAX_XFER_COUNT);
+		retval = si700x_transfer_batch(dev, reqs + index, batch,
+			XFER_PRIO_NORMAL);
+		if (retval < 0)
+			goto out;
+	}
+
+	memset(&list, 0x00, sizeof(list));
+	for (index = 0; index < count; index++) {
+		if (reqs[index].status != XFER_STATUS_SUCCESS ||
+				list.count == MAX_SLAVE_COUNT)
+			continue;
+		list.slaves[list.count].address = reqs[index].address;
+		list.slaves[list.count].port = xfer_port(reqs[index].address);
+		list.count++;
+	}
+
+	for (index = 0; index < list.count; index++)
+		si700x_fill_req(&reqs[index], XFER_TYPE_WRITE_READ,
+			list.slaves[index].address, 1, REG_DEVICE_ID, 0x00);
+	retval = si700x_transfer_batch(dev, reqs, list.count,
+		XFER_PRIO_NORMAL);
+	if (retval < 0)
+		goto out;
+	/* a slave whose ID can't be read is kept with ID 0 */
+	for (index = 0; index < list.count; index++) {
+		if (reqs[index].status != XFER_STATUS_SUCCESS) {
+			printk(KERN_ERR "Si700x: failed to read the device ID "
+				"of slave 0x%X\n", list.slaves[index].address);
+			continue;
+		}
+		list.slaves[index].device_id = reqs[index].data[0];
+	}
+
+	mutex_lock(&dev->slave_lock);
+	dev->slave_list = list;
+	mutex_unlock(&dev->slave_lock);
+	si700x_update_ports(dev);
+
+	printk(KERN_INFO "Si700x: found %u slaves\n", list.count);
+out:
+	mutex_unlock(&dev->work_lock);
+	usb_autopm_put_interface(dev->interface);
+}
+
+/*
+ * Scan the ports again once they had time to wake up. Queued under the
+ * device mutex, so no scan is queued once the disconnect has taken it.
+ */
+static void si700x_schedule_scan(struct si700x_dev *dev, unsigned int delay)
+{
+	mutex_lock(&dev->lock);
+	cancel_delayed_work(&dev->scan_work);
+	si700x_queue_work(dev, &dev->scan_work, msecs_to_jiffies(delay));
+	mutex_unlock(&dev->lock);
+}
+
+/* Wait until the slaves woken up by the resume answer */
+static void si700x_wake_work(struct work_struct *work)
+{
+	struct si700x_dev *dev = container_of(work, struct si700x_dev,
+			wake_work.work);
+	unsigned int ports;
+
+	pr_debug("Si700x: %s\n", __func__);
+
+	ports = si700x_slave_ports(dev) & ~ACCESS_ONCE(dev->asleep);
+
+	/* keep the board awake while polling it */
+	usb_autopm_get_interface_no_resume(dev->interface);
+	mutex_lock(&dev->work_lock);
+	if (ports && si700x_wait_ports(dev, ports) == 0)
+		si700x_account_resume(dev, dev->wake_start);
+	mutex_unlock(&dev->work_lock);
+	usb_autopm_put_interface(dev->interface);
+	si700x_schedule_sampler(dev);
+}
+
+static int si700x_get_slaves(struct si700x_dev *dev, unsigned long arg)
+{
+	struct si700x_slave_list list;
+
+	mutex_lock(&dev->slave_lock);
+	list = dev->slave_list;
+	mutex_unlock(&dev->slave_lock);
+
+	if (copy_to_user((void __user *)arg, &list, sizeof(list)))
+		return -EFAULT;
+	return 0;
+}
+
+static int si700x_get_stats(struct si700x_dev *dev, unsigned long arg)
+{
+	struct si700x_stats stats;
+
+	spin_lock(&dev->queue_lock);
+	stats = dev->stats;
+	spin_unlock(&dev->queue_lock);
+
+	if (copy_to_user((void __user *)arg, &stats, sizeof(stats)))
+		return -EFAULT;
+	return 0;
+}
+
+static ssize_t si700x_show_slaves(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct si700x_dev *dev = usb_get_intfdata(to_usb_interface(d));
+	struct si700x_slave_info *info;
+	ssize_t length = 0;
+
+	mutex_lock(&dev->slave_lock);
+	for (info = dev->slave_list.slaves;
+			info < dev->slave_list.slaves + dev->slave_list.count;
+			info++)
+		length += sprintf(buf + length, "0x%02X %u 0x%02X\n",
+			info->address, info->port, info->device_id);
+	mutex_unlock(&dev->slave_lock);
+	return length;
+}
+static DEVICE_ATTR(slaves, S_IRUGO, si700x_show_slaves, NULL);
+
+static ssize_t si700x_show_cpu(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct si700x_dev *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%d\n", ACCESS_ONCE(dev->cpu));
+}
+
+/* Pin the work of the board to a CPU, -1 lets it run anywhere */
+static ssize_t si700x_store_cpu(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct si700x_dev *dev = usb_get_intfdata(to_usb_interface(d));
+	int cpu;
+
+	if (kstrtoint(buf, 0, &cpu))
+		return -EINVAL;
+	if (cpu < -1 || cpu >= (int)nr_cpu_ids || (cpu >= 0 && !cpu_online(cpu)))
+		return -EINVAL;
+	/* the work moves the next time it is queued */
+	dev->cpu = cpu;
+	return count;
+}
+static DEVICE_ATTR(cpu, S_IRUGO | S_IWUSR, si700x_show_cpu, si700x_store_cpu);
+
+static ssize_t si700x_show_cache_max_age(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct si700x_dev *dev = usb_get_intfdata(to_usb_interface(d));
+
+	return sprintf(buf, "%u\n", ACCESS_ONCE(dev->cache_max_age));
+}
+
+static ssize_t si700x_store_cache_max_age(struct device *d,
+		struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct si700x_dev *dev = usb_get_intfdata(to_usb_interface(d));
+	unsigned int max_age;
+
+	if (kstrtouint(buf, 0, &max_age))
+		return -EINVAL;
+	dev->cache_max_age = max_age;
+	return count;
+}
+static DEVICE_ATTR(cache_max_age_ms, S_IRUGO | S_IWUSR,
+	si700x_show_cache_max_age, si700x_store_cache_max_age);
+
+/* Find the slave the scan found on a port, called with slave_lock held */
+static struct si700x_slave_info *si700x_port_slave(struct si700x_dev *dev,
+		int port)
+{
+	int index;
+
+	for (index = 0; index < dev->slave_list.count; index++)
+		if (dev->slave_list.slaves[index].port == port)
+			return &dev->slave_list.slaves[index];
+	return NULL;
+}
+
+/*
+ * Port files return the last reading of the slave if it is at most
+ * cache_max_age_ms old, whichever program or subscription took it, and
+ * measure the slave otherwise.
+ */
+static ssize_t si700x_show_port(struct device *d,
+		struct device_attribute *attr, char *buf)
+{
+	struct si700x_dev *dev = usb_get_intfdata(to_usb_interface(d));
+	struct si700x_port_attr *pa = container_of(attr,
+		struct si700x_port_attr, attr);
+	struct si700x_slave_info *slave, info;
+	struct si700x_result result;
+	struct si700x_times times;
+	unsigned int max_age;
+	u8 type;
+	u16 raw;
+	s32 value;
+	int retval;
+
+	type = pa->field >= PORT_HUMIDITY ? SAMPLE_HUMIDITY :
+		SAMPLE_TEMPERATURE;
+	mutex_lock(&dev->slave_lock);
+	slave = si700x_port_slave(dev, pa->port);
+	if (slave)
+		info = *slave;
+	result = dev->cache[pa->port][type == SAMPLE_HUMIDITY];
+	max_age = dev->cache_max_age;
+	mutex_unlock(&dev->slave_lock);
+	if (!slave)
+		return -ENODEV;
+
+	if (pa->field == PORT_ADDRESS)
+		return sprintf(buf, "0x%02X\n", info.address);
+	if (pa->field == PORT_DEVICE_ID)
+		return sprintf(buf, "0x%02X\n", info.device_id);
+
+	if (!result.valid || !time_before(jiffies, result.time +
+			msecs_to_jiffies(max_age))) {
+		retval = usb_autopm_get_interface(dev->interface);
+		if (retval < 0)
+			return retval;
+		retval = si700x_read_value(dev, info.address, type, &raw,
+			&value, &times, XFER_PRIO_NORMAL);
+		usb_autopm_put_interface(dev->interface);
+		if (retval)
+			return retval < 0 ? retval : -EIO;
+
+		mutex_lock(&dev->slave_lock);
+		result = dev->cache[pa->port][type == SAMPLE_HUMIDITY];
+		mutex_unlock(&dev->slave_lock);
+	}
+
+	switch (pa->field) {
+	case PORT_TEMPERATURE:
+	case PORT_HUMIDITY:
+		return sprintf(buf, "%d\n", result.value);
+	case PORT_TEMPERATURE_RAW:
+	case PORT_HUMIDITY_RAW:
+		return sprintf(buf, "%u\n", result.raw);
+	default:
+		return sprintf(buf, "%llu\n",
+			(unsigned long long)result.times.done);
+	}
+}
+
+/* Build the port<N> groups, added when the scan finds their slave */
+static void si700x_init_ports(struct si700x_dev *dev)
+{
+	struct si700x_port_attr *pa;
+	int port, field;
+
+	for (port = 0; port < MAX_SLAVE_COUNT; port++) {
+		for (field = 0; field < PORT_FIELDS; field++) {
+			pa = &dev->port_attrs[port][field];
+			sysfs_attr_init(&pa->attr.attr);
+			pa->attr.attr.name = port_fields[field];
+			pa->attr.attr.mode = S_IRUGO;
+			pa->attr.show = si700x_show_port;
+			pa->port = port;
+			pa->field = field;
+			dev->port_attr_list[port][field] = &pa->attr.attr;
+		}
+		dev->port_attr_list[port][PORT_FIELDS] = NULL;
+		snprintf(dev->port_names[port], sizeof(dev->port_names[port]),
+			"port%d", port);
+		dev->port_groups[port].name = dev->port_names[port];
+		dev->port_groups[port].attrs = dev->port_attr_list[port];
+	}
+}
+
+/*
+ * Find the slot of a slave, optionally taking a free one. Called with
+ * slave_lock held.
+ */
+static int si700x_find_slave(struct si700x_dev *dev, u8 address, int create)
+{
+	int index, free = -1;
+
+	for (index = 0; index < MAX_SLAVE_COUNT; index++) {
+		if (slave_active(&dev->slaves[index]) &&
+				dev->slaves[index].address == address)
+			return index;
+		if (!slave_active(&dev->slaves[index]) && free < 0)
+			free = index;
+	}
+	if (!create || free < 0)
+		return -1;
+
+	memset(&dev->slaves[free], 0x00, sizeof(dev->slaves[free]));
+	dev->slaves[free].address = address;
+	dev->slaves[free].next = jiffies;
+	return free;
+}
+
+static int si700x_subscribe(struct si700x_client *client, unsigned long arg)
+{
+	struct si700x_dev *dev = client->dev;
+	struct si700x_subscription sub;
+	struct si700x_slave saved;
+	unsigned int interval;
+	int index, retval;
+	u8 types;
+
+	if (copy_from_user(&sub, (void __user *)arg, sizeof(sub)))
+		return -EFAULT;
+
+	if (!sub.types || (sub.types & ~(SAMPLE_TEMPERATURE | SAMPLE_HUMIDITY)))
+		return -EINVAL;
+	if (client->capturing)
+		return -EBUSY;
+
+	mutex_lock(&dev->slave_lock);
+	index = si700x_find_slave(dev, sub.address, 1);
+	if (index < 0) {
+		mutex_unlock(&dev->slave_lock);
+		printk(KERN_ERR "Si700x: no free slot for slave 0x%X\n",
+			sub.address);
+		return -ENOSPC;
+	}
+
+	saved = dev->slaves[index];
+	types = client->types[index];
+	interval = client->interval[index];
+	client->types[index] |= sub.types;
+	client->interval[index] = sub.interval;
+	si700x_update_slave(dev, index);
+
+	/* admission control, leave everything as it was on failure */
+	retval = si700x_admit(dev);
+	if (retval) {
+		client->types[index] = types;
+		client->interval[index] = interval;
+		dev->slaves[index] = saved;
+		mutex_unlock(&dev->slave_lock);
+		return retval;
+	}
+
+	/* the first subscription starts reading from the current sample */
+	if (!client->subscribed) {
+		spin_lock(&dev->sample_lock);
+		client->cursor = dev->sample_head;
+		client->lost = 0;
+		spin_unlock(&dev->sample_lock);
+	}
+	if (!types)
+		client->subscribed++;
+	mutex_unlock(&dev->slave_lock);
+
+	cancel_delayed_work(&dev->sample_work);
+	si700x_schedule_sampler(dev);
+	return 0;
+}
+
+static int si700x_unsubscribe(struct si700x_client *client, unsigned long arg)
+{
+	struct si700x_dev *dev = client->dev;
+	struct si700x_subscription sub;
+	int index;
+
+	if (copy_from_user(&sub, (void __user *)arg, sizeof(sub)))
+		return -EFAULT;
+
+	mutex_lock(&dev->slave_lock);
+	index = si700x_find_slave(dev, sub.address, 0);
+	if (index < 0 || !client->types[index]) {
+		mutex_unlock(&dev->slave_lock);
+		return -EINVAL;
+	}
+	si700x_drop_types(client, index, sub.types ? sub.types : 0xFF);
+	mutex_unlock(&dev->slave_lock);
+	return 0;
+}
+
+static int si700x_get_rate(struct si700x_dev *dev, unsigned long arg)
+{
+	struct si700x_rate rate;
+	struct si700x_slave *slave;
+	int index;
+
+	if (copy_from_user(&rate, (void __user *)arg, sizeof(rate)))
+		return -EFAULT;
+
+	mutex_lock(&dev->slave_lock);
+	index = si700x_find_slave(dev, rate.address, 0);
+	if (index < 0) {
+		mutex_unlock(&dev->slave_lock);
+		return -EINVAL;
+	}
+	slave = &dev->slaves[index];
+	rate.types = slave->types;
+	rate.interval = slave->interval;
+	rate.periods = slave->periods;
+	rate.period = 0;
+	rate.rate = 0;
+	rate.jitter = 0;
+	rate.jitter_max = slave->jitter_max;
+	if (slave->periods) {
+		rate.period = div_u64(slave->period_sum, slave->periods);
+		rate.jitter = div_u64(slave->jitter_sum, slave->periods);
+	}
+	mutex_unlock(&dev->slave_lock);
+
+	if (rate.period)
+		rate.rate = 1000000000U / rate.period;
 
-struct si700x_dev {
-	struct usb_device *udev;		/* the usb device */
-	struct usb_interface *interface;	/* the usb interface */
-	struct transfer_req buffer;
-	int buffer_size;
-	int buffer_status;
-	struct mutex lock;
-};
-#define to_dev(d) container_of(d, struct si700x_dev, kref)
+	if (copy_to_user((void __user *)arg, &rate, sizeof(rate)))
+		return -EFAULT;
+	return 0;
+}
 
-static struct usb_driver si700x_driver;
+static int si700x_get_timing(struct si700x_dev *dev, unsigned long arg)
+{
+	struct si700x_timing timing;
+	struct si700x_timing_stats *t;
 
-static int si700x_open(struct inode *i, struct file *f)
+	if (copy_from_user(&timing, (void __user *)arg, sizeof(timing)))
+		return -EFAULT;
+
+	mutex_lock(&dev->slave_lock);
+	t = &dev->timing[xfer_port(timing.address)];
+	timing.count = t->count;
+	timing.conversion = 0;
+	timing.read = 0;
+	timing.latency = 0;
+	if (t->count) {
+		timing.conversion = div_u64(t->conversion_sum, t->count);
+		timing.read = div_u64(t->read_sum, t->count);
+		timing.latency = div_u64(t->latency_sum, t->count);
+	}
+	timing.conversion_max = t->conversion_max;
+	timing.read_max = t->read_max;
+	timing.latency_max = t->latency_max;
+	timing.jitter = t->jitter >> 4;
+	mutex_unlock(&dev->slave_lock);
+
+	if (copy_to_user((void __user *)arg, &timing, sizeof(timing)))
+		return -EFAULT;
+	return 0;
+}
+
+/* Turn the prefetch of a slave on, off or change it */
+static int si700x_set_prefetch(struct si700x_dev *dev, unsigned long arg)
 {
-	struct si700x_dev *dev;
-	struct usb_interface *interface;
-	int minor;
+	struct si700x_prefetch prefetch;
+	struct si700x_slave saved;
+	struct si700x_slave *slave;
+	int index, retval, any, pm;
 
-	pr_debug("Si700x: %s\n", __func__);
+	if (copy_from_user(&prefetch, (void __user *)arg, sizeof(prefetch)))
+		return -EFAULT;
+	if (prefetch.types & ~(SAMPLE_TEMPERATURE | SAMPLE_HUMIDITY))
+		return -EINVAL;
+	if (prefetch.types && !prefetch.max_age)
+		return -EINVAL;
+
+	mutex_lock(&dev->slave_lock);
+	index = si700x_find_slave(dev, prefetch.address, prefetch.types != 0);
+	if (index < 0) {
+		mutex_unlock(&dev->slave_lock);
+		if (!prefetch.types)
+			return 0;
+		printk(KERN_ERR "Si700x: no free slot for slave 0x%X\n",
+			prefetch.address);
+		return -ENOSPC;
+	}
+	slave = &dev->slaves[index];
+	saved = *slave;
+
+	if (!(prefetch.types & SAMPLE_TEMPERATURE))
+		slave->results[0].valid = 0;
+	if (!(prefetch.types & SAMPLE_HUMIDITY))
+		slave->results[1].valid = 0;
+	/* convert the new types right away */
+	slave->armed = prefetch.types & ~slave->prefetch;
+	slave->prefetch = prefetch.types;
+	slave->max_age = prefetch.max_age;
+
+	retval = si700x_admit(dev);
+	if (retval)
+		*slave = saved;
+
+	/*
+	 * The prefetch outlives the file that set it, keep the board awake
+	 * for the sampler while any slave is prefetched. The file holds its
+	 * own reference, so taking one doesn't need a resume.
+	 */
+	for (index = 0, any = 0; index < MAX_SLAVE_COUNT; index++)
+		if (dev->slaves[index].prefetch)
+			any = 1;
+	pm = any - dev->prefetch_pm;
+	dev->prefetch_pm = any;
+	mutex_unlock(&dev->slave_lock);
+
+	if (pm > 0)
+		usb_autopm_get_interface_no_resume(dev->interface);
+	else if (pm < 0)
+		usb_autopm_put_interface(dev->interface);
+
+	cancel_delayed_work(&dev->sample_work);
+	si700x_schedule_sampler(dev);
+	return retval;
+}
 
-	minor = iminor(i);
+/*
+ * Return the prefetched result of a slave if it is recent enough, or wait
+ * for the conversion on its way. Either way the next conversion is armed.
+ * Returns 1 with the result filled in, 0 if the slave isn't prefetched or
+ * a negative error code.
+ */
+static int si700x_read_prefetch(struct si700x_dev *dev,
+		struct si700x_measurement *m)
+{
+	unsigned long timeout = jiffies + msecs_to_jiffies(2 * SAMPLE_TIMEOUT_MS);
+	struct si700x_slave *slave;
+	struct si700x_result *result;
+	int index, armed, fresh;
+	long retval;
+	u32 seq;
+
+	for (;;) {
+		mutex_lock(&dev->slave_lock);
+		index = si700x_find_slave(dev, m->address, 0);
+		if (index < 0 || !(dev->slaves[index].prefetch & m->type)) {
+			mutex_unlock(&dev->slave_lock);
+			return 0;
+		}
+		slave = &dev->slaves[index];
+		result = &slave->results[m->type == SAMPLE_HUMIDITY];
+
+		/* unless the next result is already on its way */
+		armed = !((slave->pending | slave->armed) & m->type);
+		slave->armed |= m->type;
+
+		fresh = result->valid && time_before(jiffies, result->time +
+			msecs_to_jiffies(slave->max_age));
+		if (fresh) {
+			m->status = result->status;
+			m->raw = result->raw;
+			m->value = result->value;
+			m->start = result->times.start;
+			m->ready = result->times.ready;
+			m->done = result->times.done;
+			/* errors are returned once */
+			if (result->status != XFER_STATUS_SUCCESS)
+				result->valid = 0;
+		}
+		seq = dev->prefetch_seq;
+		mutex_unlock(&dev->slave_lock);
 
-	interface = usb_find_interface(&si700x_driver, minor);
-	if (!interface) {
-		printk(KERN_ERR "Si700x: failed to find interface "
-			"for minor %d", minor);
-		return -ENODEV;
+		if (armed) {
+			cancel_delayed_work(&dev->sample_work);
+			si700x_schedule_sampler(dev);
+		}
+		if (fresh)
+			return 1;
+
+		if (time_after(jiffies, timeout)) {
+			m->status = XFER_STATUS_TIMEOUT;
+			return 1;
+		}
+		retval = wait_event_interruptible_timeout(dev->prefetch_wait,
+			ACCESS_ONCE(dev->prefetch_seq) != seq ||
+			ACCESS_ONCE(dev->disconnected),
+			msecs_to_jiffies(SAMPLE_TIMEOUT_MS));
+		if (retval < 0)
+			return retval;
+		if (ACCESS_ONCE(dev->disconnected))
+			return -ENODEV;
 	}
+}
 
-	dev = usb_get_intfdata(interface);
-	if (!dev) {
-		printk(KERN_ERR "Si700x: failed to find device "
-			"for minor %d\n", minor);
-		return -ENODEV;
+/*
+ * Convert all the slaves found by the scan at once. The temperatures are
+ * converted first so that the humidities are compensated with them.
+ */
+static int si700x_get_snapshot(struct si700x_client *client,
+		unsigned long arg)
+{
+	struct si700x_dev *dev = client->dev;
+	struct si700x_snapshot snap;
+	struct si700x_snapshot_slave *slave;
+	struct si700x_slave_list list;
+	struct si700x_times times[MAX_SLAVE_COUNT];
+	u8 addresses[MAX_SLAVE_COUNT];
+	u8 statuses[MAX_SLAVE_COUNT];
+	u16 raws[MAX_SLAVE_COUNT];
+	s32 temperature, humidity;
+	u64 start;
+	int i, valid, retval;
+	u8 types;
+
+	if (copy_from_user(&snap, (void __user *)arg, sizeof(snap)))
+		return -EFAULT;
+	types = snap.types;
+	if (!types || (types & ~(SAMPLE_TEMPERATURE | SAMPLE_HUMIDITY)))
+		return -EINVAL;
+
+	mutex_lock(&dev->slave_lock);
+	list = dev->slave_list;
+	mutex_unlock(&dev->slave_lock);
+
+	memset(&snap, 0x00, sizeof(snap));
+	snap.types = types;
+	snap.count = list.count;
+	snap.time = ktime_to_ns(ktime_get());
+	for (i = 0; i < list.count; i++) {
+		addresses[i] = list.slaves[i].address;
+		snap.slaves[i].address = list.slaves[i].address;
+		snap.slaves[i].port = list.slaves[i].port;
+		snap.slaves[i].temperature_status = XFER_STATUS_NONE;
+		snap.slaves[i].humidity_status = XFER_STATUS_NONE;
 	}
 
-	/* save our object in the file's private structure */
-	mutex_lock(&dev->lock);
-	f->private_data = dev;
-	mutex_unlock(&dev->lock);
+	if (list.count && (types & SAMPLE_TEMPERATURE)) {
+		retval = si700x_convert_all(dev, addresses, list.count,
+			SAMPLE_TEMPERATURE, raws, statuses, times, &snap.time,
+			client->priority);
+		if (retval < 0)
+			return retval;
+		for (i = 0; i < list.count; i++) {
+			slave = &snap.slaves[i];
+			slave->temperature_status = statuses[i];
+			if (statuses[i] != XFER_STATUS_SUCCESS)
+				continue;
+			slave->temperature_raw = raws[i];
+			/* also refreshes the temperature of the port */
+			si700x_convert(dev, slave->address, SAMPLE_TEMPERATURE,
+				raws[i], &slave->temperature, client->priority);
+		}
+	}
+
+	if (list.count && (types & SAMPLE_HUMIDITY)) {
+		retval = si700x_convert_all(dev, addresses, list.count,
+			SAMPLE_HUMIDITY, raws, statuses, times, &start,
+			client->priority);
+		if (retval < 0)
+			return retval;
+		if (!(types & SAMPLE_TEMPERATURE))
+			snap.time = start;
+		for (i = 0; i < list.count; i++) {
+			slave = &snap.slaves[i];
+			slave->humidity_status = statuses[i];
+			if (statuses[i] != XFER_STATUS_SUCCESS)
+				continue;
+			slave->humidity_raw = raws[i];
+
+			/*
+			 * compensate with this snapshot, or a recent enough
+			 * temperature of the port, else leave it uncompensated
+			 */
+			valid = slave->temperature_status ==
+				XFER_STATUS_SUCCESS;
+			temperature = slave->temperature;
+			mutex_lock(&dev->slave_lock);
+			if (!valid)
+				valid = si700x_port_temperature(dev,
+					xfer_port(slave->address),
+					&temperature);
+			mutex_unlock(&dev->slave_lock);
+			humidity = HUMIDITY_LINEAR(HUMIDITY_MILLI(raws[i]));
+			if (valid)
+				humidity = HUMIDITY_COMPENSATE(humidity,
+					temperature);
+			else
+				snap.uncompensated |= 1 << i;
+			slave->humidity = HUMIDITY_CLAMP(humidity);
+			if (!valid)
+				continue;
+			mutex_lock(&dev->slave_lock);
+			si700x_cache(dev, slave->address, SAMPLE_HUMIDITY,
+				raws[i], slave->humidity, times[i].done);
+			mutex_unlock(&dev->slave_lock);
+		}
+	}
+	snap.done = ktime_to_ns(ktime_get());
+
+	if (copy_to_user((void __user *)arg, &snap, sizeof(snap)))
+		return -EFAULT;
 	return 0;
 }
 
-static int si700x_release(struct inode *i, struct file *f)
+static int si700x_measure_ioctl(struct si700x_client *client,
+		unsigned long arg)
 {
-	struct si700x_dev *dev;
+	struct si700x_measurement m;
+	struct si700x_times times;
+	int retval;
 
-	pr_debug("Si700x: %s\n", __func__);
+	if (copy_from_user(&m, (void __user *)arg, sizeof(m)))
+		return -EFAULT;
+	if (m.type != SAMPLE_TEMPERATURE && m.type != SAMPLE_HUMIDITY)
+		return -EINVAL;
 
-	dev = (struct si700x_dev *)f->private_data;
-	if (dev == NULL) {
-		printk(KERN_ERR "Si700x: failed to find device from interface\n");
-		return -ENODEV;
+	m.raw = 0;
+	m.value = 0;
+	retval = si700x_read_prefetch(client->dev, &m);
+	if (retval < 0)
+		return retval;
+	if (retval)
+		goto done;
+
+	retval = si700x_read_value(client->dev, m.address, m.type, &m.raw,
+		&m.value, &times, client->priority);
+	if (retval < 0)
+		return retval;
+	m.status = si700x_status(retval);
+	m.start = times.start;
+	m.ready = times.ready;
+	m.done = times.done;
+
+done:
+	if (copy_to_user((void __user *)arg, &m, sizeof(m)))
+		return -EFAULT;
+	return 0;
+}
+
+/*
+ * Get the next sample for the subscriptions of a client, skipping the
+ * samples of other slaves. Samples overwritten before the client got to
+ * them are counted as lost and reported with the next sample.
+ */
+static int si700x_next_sample(struct si700x_client *client,
+		struct si700x_sample *sample)
+{
+	struct si700x_dev *dev = client->dev;
+	struct si700x_sample *entry;
+	int index, found = 0;
+
+	mutex_lock(&dev->slave_lock);
+	spin_lock(&dev->sample_lock);
+	if (dev->sample_head - client->cursor > SAMPLE_RING_SIZE) {
+		client->lost += dev->sample_head - client->cursor -
+			SAMPLE_RING_SIZE;
+		client->cursor = dev->sample_head - SAMPLE_RING_SIZE;
 	}
-	mutex_lock(&dev->lock);
-	f->private_data = NULL;
-	mutex_unlock(&dev->lock);
+	while (!found && client->cursor != dev->sample_head) {
+		entry = &dev->samples[client->cursor & (SAMPLE_RING_SIZE - 1)];
+		client->cursor++;
+		index = si700x_find_slave(dev, entry->address, 0);
+		if (index < 0 || !(client->types[index] & entry->type))
+			continue;
+		*sample = *entry;
+		sample->lost = client->lost;
+		client->lost = 0;
+		found = 1;
+	}
+	spin_unlock(&dev->sample_lock);
+	mutex_unlock(&dev->slave_lock);
+	return found;
+}
+
+static ssize_t si700x_read_samples(struct file *f, char __user *user_buffer,
+		size_t count)
+{
+	struct si700x_client *client = f->private_data;
+	struct si700x_dev *dev = client->dev;
+	struct si700x_sample sample;
+	size_t copied = 0;
+	int retval;
+
+	if (count < sizeof(sample)) {
+		printk(KERN_ERR "Si700x: invalid buffer size, "
+			"it should be at least %zu bytes\n", sizeof(sample));
+		return -EINVAL;
+	}
+
+	while (copied + sizeof(sample) <= count) {
+		if (!si700x_next_sample(client, &sample)) {
+			if (copied)
+				break;
+			if (f->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			retval = wait_event_interruptible(dev->sample_wait,
+				ACCESS_ONCE(dev->sample_head) != client->cursor ||
+				ACCESS_ONCE(dev->disconnected));
+			if (retval)
+				return retval;
+			if (ACCESS_ONCE(dev->disconnected))
+				return -ENODEV;
+			continue;
+		}
+		if (copy_to_user(user_buffer + copied, &sample, sizeof(sample))) {
+			printk(KERN_ERR "Si700x: failed to copy data to user space\n");
+			return -EFAULT;
+		}
+		copied += sizeof(sample);
+	}
+	return copied;
+}
+
+/*
+ * Turn the capture mode of a file on or off. The capture ring is only
+ * allocated when the first file asks for it, and nothing is recorded
+ * while no file is capturing.
+ */
+static int si700x_set_capture(struct si700x_client *client, unsigned long arg)
+{
+	struct si700x_dev *dev = client->dev;
+	struct si700x_capture *ring = NULL;
+
+	if (arg > 1)
+		return -EINVAL;
+	if (arg == client->capturing)
+		return 0;
+
+	if (!arg) {
+		spin_lock(&dev->capture_lock);
+		dev->capture_readers--;
+		client->capturing = 0;
+		spin_unlock(&dev->capture_lock);
+		return 0;
+	}
+
+	/* no request of the file may be outstanding */
+	mutex_lock(&client->xfer_lock);
+	if (client->subscribed || client->xfer_tail != client->xfer_head) {
+		mutex_unlock(&client->xfer_lock);
+		return -EBUSY;
+	}
+	if (!ACCESS_ONCE(dev->captures)) {
+		ring = vzalloc(CAPTURE_RING_SIZE * sizeof(*ring));
+		if (!ring) {
+			printk(KERN_ERR "Si700x: failed to allocate capture ring\n");
+			mutex_unlock(&client->xfer_lock);
+			return -ENOMEM;
+		}
+	}
+
+	spin_lock(&dev->capture_lock);
+	if (!dev->captures) {
+		dev->captures = ring;
+		ring = NULL;
+	}
+	dev->capture_readers++;
+	client->capture_cursor = dev->capture_head;
+	client->capture_lost = 0;
+	client->capturing = 1;
+	spin_unlock(&dev->capture_lock);
+	mutex_unlock(&client->xfer_lock);
+
+	/* another file allocated the ring meanwhile */
+	vfree(ring);
 	return 0;
 }
 
+/* Get the next capture record, counting the records overrun as lost */
+static int si700x_next_capture(struct si700x_client *client,
+		struct si700x_capture *record)
+{
+	struct si700x_dev *dev = client->dev;
+	int found = 0;
+
+	spin_lock(&dev->capture_lock);
+	if (dev->capture_head - client->capture_cursor > CAPTURE_RING_SIZE) {
+		client->capture_lost += dev->capture_head -
+			client->capture_cursor - CAPTURE_RING_SIZE;
+		client->capture_cursor = dev->capture_head - CAPTURE_RING_SIZE;
+	}
+	if (client->capture_cursor != dev->capture_head) {
+		*record = dev->captures[client->capture_cursor &
+			(CAPTURE_RING_SIZE - 1)];
+		client->capture_cursor++;
+		record->lost = client->capture_lost;
+		client->capture_lost = 0;
+		found = 1;
+	}
+	spin_unlock(&dev->capture_lock);
+	return found;
+}
+
+static ssize_t si700x_read_captures(struct file *f, char __user *user_buffer,
+		size_t count)
+{
+	struct si700x_client *client = f->private_data;
+	struct si700x_dev *dev = client->dev;
+	struct si700x_capture record;
+	size_t copied = 0;
+	int retval;
+
+	if (count < sizeof(record)) {
+		printk(KERN_ERR "Si700x: invalid buffer size, "
+			"it should be at least %zu bytes\n", sizeof(record));
+		return -EINVAL;
+	}
+
+	while (copied + sizeof(record) <= count) {
+		if (!si700x_next_capture(client, &record)) {
+			if (copied)
+				break;
+			if (f->f_flags & O_NONBLOCK)
+				return -EAGAIN;
+			retval = wait_event_interruptible(dev->capture_wait,
+				ACCESS_ONCE(dev->capture_head) !=
+				client->capture_cursor ||
+				ACCESS_ONCE(dev->disconnected));
+			if (retval)
+				return retval;
+			if (ACCESS_ONCE(dev->disconnected))
+				return -ENODEV;
+			continue;
+		}
+		if (copy_to_user(user_buffer + copied, &record, sizeof(record))) {
+			printk(KERN_ERR "Si700x: failed to copy data to user space\n");
+			return -EFAULT;
+		}
+		copied += sizeof(record);
+	}
+	return copied;
+}
+
 /*
- * USB read function reads from the device with the address of the
- * si700x_dev.buffer which was filled by the USB write function previously.
+ * USB read function waits for the responses to the transfer requests
+ * queued by the previous USB write functions and returns them in order.
+ * Several responses can be read at once, the read stops short before the
+ * first failed one, which is reported by the next read. Subscribed files
+ * read samples instead, and capturing files read capture records.
  */
 static ssize_t si700x_read(struct file *f, char __user *user_buffer,
 		size_t count, loff_t *ppos)
 {
+	struct si700x_client *client;
 	struct si700x_dev *dev;
-	int retval = 0;
-	int actual_length = 0;
+	struct si700x_xfer *xfer;
+	size_t copied = 0;
+	ssize_t retval;
 
 	pr_debug("Si700x: %s\n", __func__);
 
-	dev = (struct si700x_dev *)f->private_data;
+	client = (struct si700x_client *)f->private_data;
+	dev = client->dev;
+
+	/* records already captured can still be read */
+	if (client->capturing)
+		return si700x_read_captures(f, user_buffer, count);
+	if (ACCESS_ONCE(dev->disconnected))
+		return -ENODEV;
+	if (client->subscribed)
+		return si700x_read_samples(f, user_buffer, count);
 
 	/* check the size of the data buffer */
-	if (count != dev->buffer_size) {
+	if (count == 0 || count % dev->buffer_size) {
 		printk(KERN_ERR "Si700x: invalid buffer size, "
-			"it should be %d bytes\n", dev->buffer_size);
-		return -EFAULT;
-	}
-
-	/* check buffer status of the previous write function */
-	if (dev->buffer_status != 1) {
-		printk(KERN_ERR "Si700x: previous URB write was not successfull\n");
+			"it should be a multiple of %d bytes\n", dev->buffer_size);
 		return -EFAULT;
 	}
 
 	/* check access to user space buffer */
-	if (!access_ok(VERIFY_WRITE, user_buffer, dev->buffer_size)) {
+	if (!access_ok(VERIFY_WRITE, user_buffer, count)) {
 		printk(KERN_ERR "Si700x: invalid user space data\n");
 		return -EFAULT;
 	}
 
-	mutex_lock(&dev->lock);
-	dev->buffer_status = 0;
+	/* threads sharing the file take the responses in turn */
+	if (mutex_lock_interruptible(&client->xfer_lock))
+		return -ERESTARTSYS;
 
-	retval = usb_bulk_msg(dev->udev,
-		usb_rcvbulkpipe(dev->udev, PIPE_DATA_IN),
-		&dev->buffer, dev->buffer_size,	/* buffer, buffer length */
-		&actual_length, 0);		/* bytes written, interval */
-	if (retval < 0) {
-		printk(KERN_ERR "Si700x: failed to read URB\n");
-		mutex_unlock(&dev->lock);
-		return retval;
+	/* check buffer status of the previous write function */
+	if (client->xfer_tail == client->xfer_head) {
+		printk(KERN_ERR "Si700x: previous URB write was not successfull\n");
+		retval = -EFAULT;
+		goto out;
 	}
 
-	/* check if the read status is ok */
-	if (dev->buffer.status != XFER_STATUS_SUCCESS) {
-		printk(KERN_ERR "Si700x: device returned error "
-			"status number %d\n", dev->buffer.status);
-		mutex_unlock(&dev->lock);
-		return -EFAULT;
-	}
+	while (copied < count && client->xfer_tail != client->xfer_head) {
+		xfer = client_xfer(client, client->xfer_tail);
 
-	/* saving the original data in the buffer for the USB read function */
-	if (copy_to_user(user_buffer, &dev->buffer, dev->buffer_size)) {
-		printk(KERN_ERR "Si700x: failed to copy data to user space\n");
-		mutex_unlock(&dev->lock);
-		return -EFAULT;
-	}
+		retval = si700x_wait(dev, xfer);
+		if (retval < 0)
+			goto failed;
 
-	dev->buffer_status = 1;
-	mutex_unlock(&dev->lock);
+		/* check if the read status is ok */
+		if (xfer->req.status != XFER_STATUS_SUCCESS) {
+			printk(KERN_ERR "Si700x: device returned error "
+				"status number %d\n", xfer->req.status);
+			retval = -EFAULT;
+			goto failed;
+		}
 
-	return actual_length;
+		if (copy_to_user(user_buffer + copied, &xfer->req,
+				dev->buffer_size)) {
+			printk(KERN_ERR "Si700x: failed to copy data to user space\n");
+			retval = copied ? copied : -EFAULT;
+			goto out;
+		}
+		xfer->state = XFER_IDLE;
+		client->xfer_tail++;
+		copied += dev->buffer_size;
+	}
+	retval = copied;
+	goto out;
+
+failed:
+	/* report the failure now, or with the next read */
+	if (copied) {
+		retval = copied;
+		goto out;
+	}
+	xfer->state = XFER_IDLE;
+	client->xfer_tail++;
+out:
+	mutex_unlock(&client->xfer_lock);
+	return retval;
 }
 
 /*
- * USB write function writes to the device and store the written data in the
- * si700x_dev.buffer which is used by the USB read function
+ * USB write function queues the transfer requests for the device, the
+ * responses are collected by the USB read function. Several requests can
+ * be written at once, and they are queued together so that they share
+ * packets.
  */
 static ssize_t si700x_write(struct file *f, const char __user *user_buffer,
 		size_t count, loff_t *ppos)
 {
+	struct si700x_client *client;
 	struct si700x_dev *dev;
-	int retval = 0;
-	int actual_length = 0;
+	struct si700x_xfer *xfer;
+	unsigned int index, requests;
+	ssize_t retval;
 
 	pr_debug("Si700x: %s\n", __func__);
 
-	dev = (struct si700x_dev *)f->private_data;
+	client = (struct si700x_client *)f->private_data;
+	dev = client->dev;
+
+	if (ACCESS_ONCE(dev->disconnected))
+		return -ENODEV;
 
 	/* check the size of the data buffer */
-	if (count != dev->buffer_size) {
+	if (count == 0 || count % dev->buffer_size) {
 		printk(KERN_ERR "Si700x: invalid buffer size, "
-			"it should be %d bytes\n", dev->buffer_size);
+			"it should be a multiple of %d bytes\n", dev->buffer_size);
 		return -EFAULT;
 	}
 
 	/* check access to user space buffer */
-	if (!access_ok(VERIFY_READ, user_buffer, dev->buffer_size)) {
+	if (!access_ok(VERIFY_READ, user_buffer, count)) {
 		printk(KERN_ERR "Si700x: invalid user space data\n");
 		return -EFAULT;
 	}
 
-	mutex_lock(&dev->lock);
-	/* saving the original data in the buffer for the USB read function */
-	if (copy_from_user(&dev->buffer, user_buffer, dev->buffer_size)) {
-		printk(KERN_ERR "Si700x: failed to copy data from user space\n");
-		mutex_unlock(&dev->lock);
-		return -EFAULT;
+	if (mutex_lock_interruptible(&client->xfer_lock))
+		return -ERESTARTSYS;
+
+	/* subscribed and capturing files only receive */
+	if (client->subscribed || client->capturing) {
+		retval = -EBUSY;
+		goto out;
 	}
 
-	dev->buffer_status = 0;
+	requests = count / dev->buffer_size;
+	if (client->xfer_head - client->xfer_tail + requests > MAX_XFER_BATCH) {
+		printk(KERN_ERR "Si700x: more than %d requests outstanding\n",
+			MAX_XFER_BATCH);
+		retval = -ENOBUFS;
+		goto out;
+	}
 
-	retval = usb_bulk_msg(dev->udev,
-		usb_sndbulkpipe(dev->udev, PIPE_DATA_OUT),
-		&dev->buffer, dev->buffer_size,	/* buffer, buffer length */
-		&actual_length, 0);		/* bytes written, interval */
-	if (retval < 0) {
-		printk(KERN_ERR "Si700x: failed to write URB\n");
-		mutex_unlock(&dev->lock);
-		return retval;
+	for (index = 0; index < requests; index++) {
+		xfer = client_xfer(client, client->xfer_head + index);
+		if (copy_from_user(&xfer->req,
+				user_buffer + index * dev->buffer_size,
+				dev->buffer_size)) {
+			printk(KERN_ERR "Si700x: failed to copy data from user space\n");
+			retval = -EFAULT;
+			goto out;
+		}
+		xfer->priority = client->priority;
 	}
 
-	dev->buffer_status = 1;
-	mutex_unlock(&dev->lock);
+	spin_lock(&dev->queue_lock);
+	for (index = 0; index < requests; index++)
+		__si700x_submit(dev, client_xfer(client, client->xfer_head++));
+	spin_unlock(&dev->queue_lock);
+	retval = count;
+out:
+	mutex_unlock(&client->xfer_lock);
+	return retval;
+}
+
+static unsigned int si700x_poll(struct file *f, poll_table *wait)
+{
+	struct si700x_client *client = f->private_data;
+	struct si700x_dev *dev = client->dev;
+	int pending;
+
+	if (client->capturing)
+		poll_wait(f, &dev->capture_wait, wait);
+	else if (client->subscribed)
+		poll_wait(f, &dev->sample_wait, wait);
+
+	if (ACCESS_ONCE(dev->disconnected))
+		return POLLERR | POLLHUP;
 
-	return actual_length;
+	if (client->capturing) {
+		if (ACCESS_ONCE(dev->capture_head) != client->capture_cursor)
+			return POLLIN | POLLRDNORM;
+		return 0;
+	}
+
+	if (!client->subscribed) {
+		mutex_lock(&client->xfer_lock);
+		pending = client->xfer_tail != client->xfer_head;
+		mutex_unlock(&client->xfer_lock);
+		if (pending)
+			return POLLOUT | POLLWRNORM | POLLIN | POLLRDNORM;
+		return POLLOUT | POLLWRNORM;
+	}
+
+	if (ACCESS_ONCE(dev->sample_head) != client->cursor)
+		return POLLIN | POLLRDNORM;
+	return 0;
 }
 
 static long si700x_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 {
+	struct si700x_client *client;
 	struct si700x_dev *dev;
 	int retval = 0;
 	u16 version = 0;
 	u8 port_count = 0;
 	u8 board_id = 0;
 	u16 port_id = 0;
+	ktime_t start;
 
 	pr_debug("Si700x: %s\n", __func__);
 
-	dev = (struct si700x_dev *)f->private_data;
+	client = (struct si700x_client *)f->private_data;
+	dev = client->dev;
 
 	/* check if the ioctl is for the right device and within range */
 	if (_IOC_NR(cmd) > SI700X_IOC_MAXNR)
@@ -259,16 +2910,54 @@ static long si700x_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	if (retval)
 		return -EFAULT;
 
-	mutex_lock(&dev->lock);
+	if (ACCESS_ONCE(dev->disconnected))
+		return -ENODEV;
+
+	/* requests that don't take the device mutex */
+	switch (cmd) {
+	case SI700X_SUBSCRIBE:
+		return si700x_subscribe(client, arg);
+	case SI700X_UNSUBSCRIBE:
+		return si700x_unsubscribe(client, arg);
+	case SI700X_SLAVES:
+		return si700x_get_slaves(dev, arg);
+	case SI700X_STATS:
+		return si700x_get_stats(dev, arg);
+	case SI700X_RATE:
+		return si700x_get_rate(dev, arg);
+	case SI700X_TIMING:
+		return si700x_get_timing(dev, arg);
+	case SI700X_CAPTURE:
+		return si700x_set_capture(client, arg);
+	case SI700X_PREFETCH:
+		return si700x_set_prefetch(dev, arg);
+	case SI700X_SETPRIORITY:
+		if (arg >= XFER_PRIO_COUNT)
+			return -EINVAL;
+		/* applies from the next write */
+		client->priority = arg;
+		return 0;
+
+	/* conversions, queued on the board like the writes */
+	case SI700X_MEASURE:
+		return si700x_measure_ioctl(client, arg);
+	case SI700X_SNAPSHOT:
+		return si700x_get_snapshot(client, arg);
+	}
+
+	si700x_lock(dev);
+	if (dev->disconnected) {
+		retval = -ENODEV;
+		goto error;
+	}
 	switch (cmd) {
 
 	case SI700X_LED_ON:
 		/* turn on the LED */
-		retval = usb_control_msg(dev->udev,
-			usb_sndctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_SET_LED, CMD_VEN_DEV_OUT,
 			1, 0,			/* value, index */
-			NULL, 0, 0);		/* data, size, timeout */
+			NULL, 0);		/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to turn ON the LED\n");
 			goto error;
@@ -278,11 +2967,10 @@ static long si700x_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 
 	case SI700X_LED_OFF:
 		/* turn off the LED */
-		retval = usb_control_msg(dev->udev,
-			usb_sndctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_SET_LED, CMD_VEN_DEV_OUT,
 			0, 0,			/* value, index */
-			NULL, 0, 0);		/* data, size, timeout */
+			NULL, 0);		/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to turn OFF the LED\n");
 			goto error;
@@ -292,53 +2980,52 @@ static long si700x_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 
 	case SI700X_VERSION:
 		/* read vesion number from the board */
-		retval = usb_control_msg(dev->udev,
-			usb_rcvctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_GET_VERSION, CMD_VEN_DEV_IN,
 			0, 0,			/* value, index */
-			&version, 2, 0);	/* data, size, timeout */
+			dev->ctrl_buffer, 2);	/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to read version number\n");
 			goto error;
 		}
+		version = dev->ctrl_buffer[0] | (dev->ctrl_buffer[1] << 8);
 		mutex_unlock(&dev->lock);
 		return __put_user(version, (u16 __user *)arg);
 
 	case SI700X_PORT_COUNT:
 		/* read port count from the board */
-		retval = usb_control_msg(dev->udev,
-			usb_rcvctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_GET_PORT_COUNT, CMD_VEN_DEV_IN,
 			0, 0,			/* value, index */
-			&port_count, 1, 0);	/* data, size, timeout */
+			dev->ctrl_buffer, 1);	/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to read port count\n");
 			goto error;
 		}
+		port_count = dev->ctrl_buffer[0];
 		mutex_unlock(&dev->lock);
 		return __put_user(port_count, (u8 __user *)arg);
 
 	case SI700X_BOARDID:
 		/* read board id from the board */
-		retval = usb_control_msg(dev->udev,
-			usb_rcvctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_GET_BOARD_ID, CMD_VEN_DEV_IN,
 			0, 0,			/* value, index */
-			&board_id, 1, 0);	/* data, size, timeout */
+			dev->ctrl_buffer, 1);	/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to read board id\n");
 			goto error;
 		}
+		board_id = dev->ctrl_buffer[0];
 		mutex_unlock(&dev->lock);
 		return __put_user(board_id, (u8 __user *)arg);
 
 	case SI700X_SETPROG_ON:
 		/* turn on programming */
-		retval = usb_control_msg(dev->udev,
-			usb_sndctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_SET_PROG, CMD_VEN_DEV_OUT,
 			1, 0,			/* value, index - port */
-			NULL, 0, 0);		/* data, size, timeout */
+			NULL, 0);		/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to turn ON the programming mode\n");
 			goto error;
@@ -348,11 +3035,10 @@ static long si700x_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 
 	case SI700X_SETPROG_OFF:
 		/* turn off programming */
-		retval = usb_control_msg(dev->udev,
-			usb_sndctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_SET_PROG, CMD_VEN_DEV_OUT,
 			0, 0,			/* value, index - port */
-			NULL, 0, 0);		/* data, size, timeout */
+			NULL, 0);		/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to turn OFF the programming mode\n");
 			goto error;
@@ -363,33 +3049,51 @@ static long si700x_ioctl(struct file *f, unsigned int cmd, unsigned long arg)
 	case SI700X_SETSLEEP_ON:
 		port_id = arg;
 		/* turn on sleeping */
-		retval = usb_control_msg(dev->udev,
-			usb_sndctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_SET_SLEEP, CMD_VEN_DEV_OUT,
-			0, port_id,		/* value, index - port */
-			NULL, 0, 0);		/* data, size, timeout */
+			1, port_id,		/* value, index - port */
+			NULL, 0);		/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to turn ON the sleeping "
 				"for port %d\n", port_id);
 			goto error;
 		}
+		/* kept asleep across suspend and resume */
+		if (port_id < MAX_SLAVE_COUNT)
+			dev->asleep |= 1 << port_id;
 		mutex_unlock(&dev->lock);
 		return 0;
 
 	case SI700X_SETSLEEP_OFF:
 		port_id = arg;
+		start = ktime_get();
 		/* turn off sleeping */
-		retval = usb_control_msg(dev->udev,
-			usb_sndctrlpipe(dev->udev, 0),
+		retval = si700x_control_msg(dev,
 			REQ_SET_SLEEP, CMD_VEN_DEV_OUT,
 			0, port_id,		/* value, index - port */
-			NULL, 0, 0);		/* data, size, timeout */
+			NULL, 0);		/* data, size */
 		if (retval < 0) {
 			printk(KERN_ERR "Si700x: failed to turn OFF the sleeping "
 					"for port %d\n", port_id);
 			goto error;
 		}
+		if (port_id < MAX_SLAVE_COUNT)
+			dev->asleep &= ~(1 << port_id);
 		mutex_unlock(&dev->lock);
+
+		/*
+		 * Return once the sensors of the port answer. A port the
+		 * last scan found empty returns at once and is scanned when
+		 * it had the time to wake up.
+		 */
+		if (port_id >= MAX_SLAVE_COUNT ||
+				!(si700x_slave_ports(dev) & (1 << port_id))) {
+			si700x_schedule_scan(dev, SCAN_WAKE_DELAY_MS);
+			return 0;
+		}
+		if (si700x_wait_ports(dev, 1 << port_id) == 0)
+			si700x_account_resume(dev, start);
+		si700x_schedule_scan(dev, 0);
 		return 0;
 
 	}
@@ -405,6 +3109,7 @@ static const struct file_operations si700x_fops = {
 	.release = si700x_release,
 	.read = si700x_read,
 	.write = si700x_write,
+	.poll = si700x_poll,
 	.unlocked_ioctl = si700x_ioctl,
 };
 
@@ -419,7 +3124,9 @@ static int si700x_probe(struct usb_interface *interface,
 {
 	struct si700x_dev *dev = NULL;
 	struct usb_host_interface *iface_desc;
+	struct usb_endpoint_descriptor *endpoint;
 	int retval = -ENOMEM;
+	int i, j;
 
 	pr_debug("Si700x: %s\n", __func__);
 
@@ -428,15 +3135,75 @@ static int si700x_probe(struct usb_interface *interface,
 		printk(KERN_ERR "Si700x: failed to allocate memory for device\n");
 		return -ENOMEM;
 	}
-	memset(dev, 0x00, sizeof(dev));
+	memset(dev, 0x00, sizeof(struct si700x_dev));
+
+	dev->ctrl_buffer = kmalloc(sizeof(u16), GFP_KERNEL);
+	if (!dev->ctrl_buffer) {
+		printk(KERN_ERR "Si700x: failed to allocate memory for device\n");
+		kfree(dev);
+		return -ENOMEM;
+	}
 
+	kref_init(&dev->kref);
 	mutex_init(&dev->lock);
+	mutex_init(&dev->slave_lock);
+	INIT_LIST_HEAD(&dev->clients);
+	for (i = 0; i < XFER_PRIO_COUNT; i++)
+		for (j = 0; j < MAX_SLAVE_COUNT; j++)
+			INIT_LIST_HEAD(&dev->queues[i][j]);
+	spin_lock_init(&dev->queue_lock);
+	spin_lock_init(&dev->urb_lock);
+	init_usb_anchor(&dev->anchor);
+	INIT_DELAYED_WORK(&dev->sample_work, si700x_sample_work);
+	INIT_DELAYED_WORK(&dev->scan_work, si700x_scan_work);
+	INIT_DELAYED_WORK(&dev->wake_work, si700x_wake_work);
+	spin_lock_init(&dev->sample_lock);
+	init_waitqueue_head(&dev->sample_wait);
+	init_waitqueue_head(&dev->prefetch_wait);
+	spin_lock_init(&dev->capture_lock);
+	init_waitqueue_head(&dev->capture_wait);
+
 	mutex_lock(&dev->lock);
-	dev->interface = interface;
-	dev->udev = interface_to_usbdev(interface);
-	dev->buffer_size = sizeof(dev->buffer);
+	/* the works may still use the interface after the disconnect */
+	dev->interface = usb_get_intf(interface);
+	dev->udev = usb_get_dev(interface_to_usbdev(interface));
+	dev->buffer_size = sizeof(struct transfer_req);
+	dev->cpu = -1;
+	dev->cache_max_age = cache_max_age_ms;
+
+	/*
+	 * One workqueue per board, so boards don't wait on each other. It is
+	 * bound so that the work can be pinned to a CPU, and work_lock keeps
+	 * the works of the board from running at once on different CPUs.
+	 */
+	mutex_init(&dev->work_lock);
+	dev->wq = alloc_workqueue("si700x", WQ_MEM_RECLAIM, 1);
+	if (!dev->wq) {
+		printk(KERN_ERR "Si700x: failed to allocate workqueue\n");
+		mutex_unlock(&dev->lock);
+		kref_put(&dev->kref, si700x_delete);
+		return -ENOMEM;
+	}
 
+	/* polling intervals of the data pipes */
+	dev->interval_out = 1;
+	dev->interval_in = 1;
 	iface_desc = interface->cur_altsetting;
+	for (i = 0; i < iface_desc->desc.bNumEndpoints; i++) {
+		endpoint = &iface_desc->endpoint[i].desc;
+		if (endpoint->bEndpointAddress == PIPE_DATA_OUT)
+			dev->interval_out = endpoint->bInterval;
+		else if (endpoint->bEndpointAddress == PIPE_DATA_IN)
+			dev->interval_in = endpoint->bInterval;
+	}
+
+	retval = si700x_alloc_urbs(dev);
+	if (retval < 0) {
+		printk(KERN_ERR "Si700x: failed to allocate URBs\n");
+		mutex_unlock(&dev->lock);
+		kref_put(&dev->kref, si700x_delete);
+		return retval;
+	}
 
 	usb_set_intfdata(interface, dev);
 
@@ -445,30 +3212,161 @@ static int si700x_probe(struct usb_interface *interface,
 		printk(KERN_ERR "Si700x: failed to get minor number\n");
 		usb_set_intfdata(interface, NULL);
 		mutex_unlock(&dev->lock);
-		kfree(dev);
+		kref_put(&dev->kref, si700x_delete);
 		return retval;
 	}
 	mutex_unlock(&dev->lock);
+
+	if (device_create_file(&interface->dev, &dev_attr_slaves) ||
+			device_create_file(&interface->dev, &dev_attr_cpu) ||
+			device_create_file(&interface->dev,
+				&dev_attr_cache_max_age_ms))
+		printk(KERN_ERR "Si700x: failed to create sysfs attributes\n");
+	si700x_init_ports(dev);
+
+	/* suspend the board when it has been unused for a while */
+	pm_runtime_set_autosuspend_delay(&dev->udev->dev, autosuspend_delay_ms);
+	usb_enable_autosuspend(dev->udev);
+	si700x_schedule_scan(dev, 0);
+
 	printk(KERN_INFO "Si700x: minor number %d\n", interface->minor);
 	return 0;
 }
 
+/*
+ * The board is gone, but files may still be open and waiting. Every URB in
+ * flight is killed and the pool is poisoned so the waiters fail at once
+ * with -ENODEV, and the device is freed when the last file is closed.
+ */
 static void si700x_disconnect(struct usb_interface *interface)
 {
 	struct si700x_dev *dev;
+	struct si700x_urb *u;
 	int minor = interface->minor;
+	int i;
 
 	pr_debug("Si700x: %s\n", __func__);
 
 	dev = usb_get_intfdata(interface);
+	dev->disconnected = 1;
+	smp_wmb();
+	for (u = dev->urbs; u < dev->urbs + URB_POOL_SIZE; u++)
+		usb_poison_urb(u->urb);
+
+	/*
+	 * waits for the packet or control request in progress to fail, and
+	 * for a scan being queued
+	 */
 	mutex_lock(&dev->lock);
 	usb_deregister_dev(interface, &si700x_class);
-	usb_set_intfdata(interface, NULL);
 	mutex_unlock(&dev->lock);
-	kfree(dev);
+
+	/* the scan updates the port groups */
+	cancel_delayed_work_sync(&dev->wake_work);
+	cancel_delayed_work_sync(&dev->scan_work);
+	device_remove_file(&interface->dev, &dev_attr_slaves);
+	device_remove_file(&interface->dev, &dev_attr_cpu);
+	device_remove_file(&interface->dev, &dev_attr_cache_max_age_ms);
+	for (i = 0; i < MAX_SLAVE_COUNT; i++)
+		if (dev->ports_shown & (1 << i))
+			sysfs_remove_group(&interface->dev.kobj,
+				&dev->port_groups[i]);
+	usb_set_intfdata(interface, NULL);
+
+	/* stop sampling, the USB core drops the PM reference of the prefetch */
+	mutex_lock(&dev->slave_lock);
+	memset(dev->slaves, 0x00, sizeof(dev->slaves));
+	dev->prefetch_pm = 0;
+	mutex_unlock(&dev->slave_lock);
+	cancel_delayed_work_sync(&dev->sample_work);
+	wake_up_interruptible(&dev->sample_wait);
+	wake_up_interruptible(&dev->prefetch_wait);
+	wake_up_interruptible(&dev->capture_wait);
+
+	kref_put(&dev->kref, si700x_delete);
 	printk(KERN_INFO "Si700x: USB #%d now disconnted\n", minor);
 }
 
+/*
+ * Put the ports to sleep. Runtime suspend only happens once no file is
+ * open and the scan is done, a system suspend waits for the packet in
+ * flight and stops the sampler.
+ */
+static int si700x_suspend(struct usb_interface *interface,
+		pm_message_t message)
+{
+	struct si700x_dev *dev = usb_get_intfdata(interface);
+	int port, port_count, retval;
+
+	pr_debug("Si700x: %s\n", __func__);
+
+	if (!dev)
+		return 0;
+	cancel_delayed_work_sync(&dev->wake_work);
+	cancel_delayed_work_sync(&dev->sample_work);
+
+	mutex_lock(&dev->slave_lock);
+	port_count = dev->port_count;
+	mutex_unlock(&dev->slave_lock);
+
+	/* the ports put to sleep by the user already are */
+	mutex_lock(&dev->lock);
+	for (port = 0; port < port_count; port++) {
+		if (dev->asleep & (1 << port))
+			continue;
+		retval = si700x_control_msg(dev,
+			REQ_SET_SLEEP, CMD_VEN_DEV_OUT,
+			1, port,		/* value, index - port */
+			NULL, 0);		/* data, size */
+		if (retval < 0)
+			printk(KERN_ERR "Si700x: failed to turn ON the sleeping "
+				"for port %d\n", port);
+	}
+	mutex_unlock(&dev->lock);
+
+	spin_lock(&dev->queue_lock);
+	dev->stats.suspends++;
+	spin_unlock(&dev->queue_lock);
+	return 0;
+}
+
+/*
+ * Wake the ports the user didn't put to sleep. The wait for the slaves is
+ * left to wake_work so that resume returns at once, open() waits for it.
+ */
+static int si700x_resume(struct usb_interface *interface)
+{
+	struct si700x_dev *dev = usb_get_intfdata(interface);
+	int port, port_count, retval;
+
+	pr_debug("Si700x: %s\n", __func__);
+
+	if (!dev)
+		return 0;
+
+	mutex_lock(&dev->slave_lock);
+	port_count = dev->port_count;
+	mutex_unlock(&dev->slave_lock);
+
+	dev->wake_start = ktime_get();
+	mutex_lock(&dev->lock);
+	for (port = 0; port < port_count; port++) {
+		if (dev->asleep & (1 << port))
+			continue;
+		retval = si700x_control_msg(dev,
+			REQ_SET_SLEEP, CMD_VEN_DEV_OUT,
+			0, port,		/* value, index - port */
+			NULL, 0);		/* data, size */
+		if (retval < 0)
+			printk(KERN_ERR "Si700x: failed to turn OFF the sleeping "
+				"for port %d\n", port);
+	}
+	mutex_unlock(&dev->lock);
+
+	si700x_queue_work(dev, &dev->wake_work, 0);
+	return 0;
+}
+
 static struct usb_device_id si700x_table[] = {
 	{ USB_DEVICE(0x10c4, 0x8649) },
 	{}
@@ -479,7 +3377,11 @@ static struct usb_driver si700x_driver = {
 	.name = "si700x",
 	.probe = si700x_probe,
 	.disconnect = si700x_disconnect,
+	.suspend = si700x_suspend,
+	.resume = si700x_resume,
+	.reset_resume = si700x_resume,
 	.id_table = si700x_table,
+	.supports_autosuspend = 1,
 };
 
 static int __init si700x_init(void)
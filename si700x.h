@@ -1,10 +1,12 @@
 #ifndef _SI700X_H
 #define _SI700X_H
 
+#include <linux/types.h>
+
 /* IOCTL definitions */
 
 #define SI700X_IOC_MAGIC 'k'
-#define SI700X_IOC_MAXNR 9
+#define SI700X_IOC_MAXNR 20
 
 #define SI700X_LED_ON		_IO(SI700X_IOC_MAGIC, 1)
 #define SI700X_LED_OFF		_IO(SI700X_IOC_MAGIC, 2)
@@ -15,11 +17,28 @@
 #define SI700X_SETPROG_OFF	_IO(SI700X_IOC_MAGIC, 7)
 #define SI700X_SETSLEEP_ON	_IOW(SI700X_IOC_MAGIC, 8, unsigned int)
 #define SI700X_SETSLEEP_OFF	_IOW(SI700X_IOC_MAGIC, 9, unsigned int)
+#define SI700X_SUBSCRIBE	_IOW(SI700X_IOC_MAGIC, 10, struct si700x_subscription)
+#define SI700X_UNSUBSCRIBE	_IOW(SI700X_IOC_MAGIC, 11, struct si700x_subscription)
+#define SI700X_SETPRIORITY	_IOW(SI700X_IOC_MAGIC, 12, unsigned int)
+#define SI700X_SLAVES		_IOR(SI700X_IOC_MAGIC, 13, struct si700x_slave_list)
+#define SI700X_MEASURE		_IOWR(SI700X_IOC_MAGIC, 14, struct si700x_measurement)
+#define SI700X_STATS		_IOR(SI700X_IOC_MAGIC, 15, struct si700x_stats)
+#define SI700X_RATE		_IOWR(SI700X_IOC_MAGIC, 16, struct si700x_rate)
+#define SI700X_TIMING		_IOWR(SI700X_IOC_MAGIC, 17, struct si700x_timing)
+#define SI700X_CAPTURE		_IOW(SI700X_IOC_MAGIC, 18, unsigned int)
+#define SI700X_PREFETCH		_IOW(SI700X_IOC_MAGIC, 19, struct si700x_prefetch)
+#define SI700X_SNAPSHOT		_IOWR(SI700X_IOC_MAGIC, 20, struct si700x_snapshot)
 
 #define XFER_TYPE_WRITE          0x10
 #define XFER_TYPE_READ           0x20
 #define XFER_TYPE_WRITE_READ    (XFER_TYPE_WRITE|XFER_TYPE_READ)
 
+/* Transfer priority, realtime transfers are always sent first */
+#define XFER_PRIO_REALTIME       0
+#define XFER_PRIO_NORMAL         1
+#define XFER_PRIO_BACKGROUND     2
+#define XFER_PRIO_COUNT          3
+
 /* Slave Address */
 #define SLAVE_NEW          0x40
 #define SLAVE_LEGACY       0X20
@@ -44,10 +63,47 @@
 /* Config 2 Register */
 #define CFG2_EN_TEST_REG   0x80
 
+/* Raw conversion result from the DATAh and DATAl registers */
+#define TEMPERATURE_RAW(h, l)  ((((h) & 0xFF) << 6) | (((l) & 0xFF) >> 2))
+#define HUMIDITY_RAW(h, l)     ((((h) & 0xFF) << 4) | (((l) & 0xFF) >> 4))
+
 /* Coefficients */
 #define TEMPERATURE_OFFSET 50
-#define HUMIDITY_OFFSET    16
-#define SLOPE              32
+#define TEMPERATURE_SLOPE  32
+#define HUMIDITY_OFFSET    24
+#define HUMIDITY_SLOPE     16
+#define SLOPE              TEMPERATURE_SLOPE
+
+/*
+ * Humidity linearization and temperature compensation of the Si7005
+ * datasheet, in binary fixed point :
+ * RHlinear = RH - (A2 * RH^2 + A1 * RH + A0)
+ * RHcompensated = RHlinear + (T - 30) * (RHlinear * Q1 + Q0)
+ */
+#define HUMIDITY_A0        (-4784LL)          /* -4.7844 in milli-percent */
+#define HUMIDITY_A1        420269LL           /* 0.4008 * 2^20 */
+#define HUMIDITY_A2        (-4321081LL)       /* -0.00393 / 1000 * 2^40 */
+#define HUMIDITY_Q0        216933644160LL     /* 0.1973 * 2^40 */
+#define HUMIDITY_Q1        2605843LL          /* 0.00237 / 1000 * 2^40 */
+
+/*
+ * Conversion of the raw results to milli-degree Celsius and milli-percent
+ * relative humidity, using integer arithmetic only so the driver and the
+ * programs get the same numbers. The humidity is HUMIDITY_CLAMP() of
+ * HUMIDITY_COMPENSATE() of HUMIDITY_LINEAR() of HUMIDITY_MILLI().
+ */
+#define TEMPERATURE_MILLI(raw) \
+	((int)((raw) * 1000 / TEMPERATURE_SLOPE) - TEMPERATURE_OFFSET * 1000)
+#define HUMIDITY_MILLI(raw) \
+	((int)((raw) * 1000 / HUMIDITY_SLOPE) - HUMIDITY_OFFSET * 1000)
+#define HUMIDITY_LINEAR(rh) \
+	((int)((rh) - ((HUMIDITY_A2 * (rh) * (rh)) >> 40) - \
+		((HUMIDITY_A1 * (rh)) >> 20) - HUMIDITY_A0))
+#define HUMIDITY_COMPENSATE(rh, t) \
+	((int)((rh) + ((((t) - 30000LL) * \
+		(HUMIDITY_Q1 * (rh) + HUMIDITY_Q0)) >> 40)))
+#define HUMIDITY_CLAMP(rh) \
+	((rh) < 0 ? 0 : (rh) > 100000 ? 100000 : (rh))
 
 /* Return codes */
 #define SUCCESS             0      /* Success                      */
@@ -67,6 +123,7 @@
 #define XFER_STATUS_BAD_LENGTH   0x06
 #define XFER_STATUS_BAD_MODE     0x07
 #define XFER_STATUS_BAD_STATE    0x09
+#define XFER_STATUS_COUNT        0x0A
 
 /* Pipes */
 #define PIPE_DATA_OUT      0x02
@@ -99,4 +156,213 @@
 /* Maximum number of transfer requests in a packet */
 #define MAX_XFER_COUNT   (MAX_PACKET_SIZE/(4+MAX_XFER_LENGTH))
 
+/* Maximum number of transfer requests a file can have outstanding */
+#define MAX_XFER_BATCH   32
+
+/* Usb transfer request */
+struct transfer_req {
+	__u8 type;
+	__u8 status;
+	__u8 address;
+	__u8 length;
+	__u8 data[MAX_XFER_LENGTH];
+} __attribute__ ((__packed__));
+
+/* Sample types */
+#define SAMPLE_TEMPERATURE 0x01
+#define SAMPLE_HUMIDITY    0x02
+
+/*
+ * Subscription to the samples of one slave. Once a file has subscribed,
+ * read() on it returns struct si700x_sample records instead of transfer
+ * responses. The driver acquires each sample once, at the shortest
+ * interval requested, and delivers it to every subscribed file.
+ * Subscriptions are refused with EINVAL if the interval is too short for
+ * the conversions of the slave and with EBUSY if the sampled slaves would
+ * take more than half of the data pipe packets.
+ */
+struct si700x_subscription {
+	__u8 address;		/* slave address */
+	__u8 types;		/* SAMPLE_* mask, 0 on unsubscribe means all */
+	__u16 interval;		/* sampling interval in milliseconds */
+};
+
+/*
+ * Slaves found on the ports of the board, scanned by the driver at probe
+ * and after the ports wake up.
+ */
+struct si700x_slave_info {
+	__u8 address;		/* slave address */
+	__u8 port;		/* board port */
+	__u8 device_id;		/* REG_DEVICE_ID register, 0 if unread */
+	__u8 reserved;
+};
+
+struct si700x_slave_list {
+	__u32 count;
+	struct si700x_slave_info slaves[MAX_SLAVE_COUNT];
+};
+
+/*
+ * Samples and measurements carry the CLOCK_MONOTONIC time in nanoseconds
+ * at which the conversion was started, found ready and read back. Steps
+ * not reached by a failed conversion are 0.
+ */
+struct si700x_sample {
+	__u32 sequence;		/* position in the device sample stream */
+	__u32 lost;		/* samples overrun before this one */
+	__u8 address;		/* slave address */
+	__u8 type;		/* SAMPLE_TEMPERATURE or SAMPLE_HUMIDITY */
+	__u8 status;		/* XFER_STATUS_* of the conversion */
+	__u8 reserved;
+	__u16 raw;		/* raw conversion result */
+	__u16 reserved2;
+	__s32 value;		/* milli-degree Celsius or milli-percent */
+	__u32 reserved3;
+	__u64 start;		/* conversion started */
+	__u64 ready;		/* status register showed the result ready */
+	__u64 done;		/* result read */
+};
+
+/*
+ * Single conversion on a slave. The humidity is linearized and compensated
+ * with the last temperature of the slave, measured first if it is too old.
+ */
+struct si700x_measurement {
+	__u8 address;		/* slave address */
+	__u8 type;		/* SAMPLE_TEMPERATURE or SAMPLE_HUMIDITY */
+	__u8 status;		/* XFER_STATUS_* of the conversion */
+	__u8 reserved;
+	__u16 raw;		/* raw conversion result */
+	__u16 reserved2;
+	__s32 value;		/* milli-degree Celsius or milli-percent */
+	__u32 reserved3;
+	__u64 start;		/* as in struct si700x_sample */
+	__u64 ready;
+	__u64 done;
+};
+
+/*
+ * Prefetch of the conversions of one slave. The driver keeps the last
+ * result of every prefetched type and starts the next conversion as soon
+ * as SI700X_MEASURE returned it, so SI700X_MEASURE returns at once with a
+ * result at most max_age milliseconds old, or waits for the conversion
+ * on its way. Prefetching is a setting of the board, types 0 turns it
+ * off. It is refused like a subscription if the bus is too busy.
+ */
+struct si700x_prefetch {
+	__u8 address;		/* slave address */
+	__u8 types;		/* SAMPLE_* mask */
+	__u16 max_age;		/* oldest result returned in milliseconds */
+};
+
+/*
+ * Snapshot of all the slaves found by the scan. The conversions of every
+ * slave are started in the same packet, temperature first, then polled and
+ * read together, so all the results are taken within one frame of each
+ * other. The humidity is compensated with the temperature of the same
+ * snapshot when it was requested.
+ */
+struct si700x_snapshot_slave {
+	__u8 address;		/* slave address */
+	__u8 port;		/* board port */
+	__u8 temperature_status;	/* XFER_STATUS_*, NONE if not requested */
+	__u8 humidity_status;
+	__u16 temperature_raw;
+	__u16 humidity_raw;
+	__s32 temperature;	/* milli-degree Celsius */
+	__s32 humidity;		/* milli-percent */
+};
+
+struct si700x_snapshot {
+	__u8 types;		/* SAMPLE_* mask to convert */
+	__u8 count;		/* slaves returned */
+	__u16 uncompensated;	/* bit i : humidity i not compensated */
+	__u32 reserved2;
+	__u64 time;		/* CLOCK_MONOTONIC ns the conversions started */
+	__u64 done;		/* CLOCK_MONOTONIC ns the last result was read */
+	struct si700x_snapshot_slave slaves[MAX_SLAVE_COUNT];
+};
+
+/*
+ * Conversion timing of the slave on a port, over all the successful
+ * conversions since the board was plugged in, in microseconds. The
+ * conversion time runs from start to ready, the read time from ready to
+ * done and the latency from start to done. The jitter is the smoothed
+ * difference between consecutive latencies, as in RFC 3550.
+ */
+struct si700x_timing {
+	__u8 address;		/* slave address, set by the caller */
+	__u8 reserved[3];
+	__u32 count;		/* conversions measured */
+	__u32 conversion;	/* average conversion time */
+	__u32 conversion_max;
+	__u32 read;		/* average read time */
+	__u32 read_max;
+	__u32 latency;		/* average latency */
+	__u32 latency_max;
+	__u32 jitter;		/* latency jitter */
+};
+
+/*
+ * Achieved sampling rate of a subscribed slave, measured over the periods
+ * since its interval last changed. A period ends when all its conversions
+ * are done, the jitter is the difference between a period and the interval.
+ */
+struct si700x_rate {
+	__u8 address;		/* slave address, set by the caller */
+	__u8 types;		/* SAMPLE_* sampled */
+	__u16 interval;		/* target interval in milliseconds */
+	__u32 periods;		/* periods measured */
+	__u32 period;		/* average period in microseconds */
+	__u32 rate;		/* average rate in milli-Hertz */
+	__u32 jitter;		/* average jitter in microseconds */
+	__u32 jitter_max;	/* largest jitter in microseconds */
+};
+
+/* Capture record types */
+#define CAPTURE_PACKET_OUT 0x01
+#define CAPTURE_PACKET_IN  0x02
+#define CAPTURE_CONTROL    0x03
+
+/*
+ * Record of the transfers with the board. SI700X_CAPTURE with 1 turns a
+ * file into a capture reader, read() then returns one record for every
+ * packet sent on PIPE_DATA_OUT, every response on PIPE_DATA_IN and every
+ * control request, from all the files. Records overwritten before they
+ * were read are reported in 'lost'. SI700X_CAPTURE with 0 turns it back.
+ */
+struct si700x_capture {
+	__u64 time;		/* CLOCK_MONOTONIC in nanoseconds */
+	__u32 sequence;		/* position in the capture stream */
+	__u32 lost;		/* records overrun before this one */
+	__u8 type;		/* CAPTURE_* */
+	__u8 count;		/* transfer requests in the packet */
+	__u8 request;		/* control request */
+	__u8 request_type;
+	__u16 value;		/* control value */
+	__u16 index;		/* control index */
+	__u16 length;		/* control data length */
+	__u16 reserved;
+	__s32 result;		/* requests or bytes transferred, or -errno */
+	__u8 data[8];		/* control data */
+	struct transfer_req reqs[MAX_XFER_COUNT];
+};
+
+/* Transfer counters of a board since it was plugged in */
+struct si700x_stats {
+	__u64 packets;		/* packets sent on the data pipes */
+	__u64 packet_errors;	/* packets failed on the USB level */
+	__u64 requests;		/* requests answered by the board */
+	__u64 status[XFER_STATUS_COUNT];	/* responses per XFER_STATUS_* */
+	__u64 status_unknown;	/* responses with any other status */
+	__u64 lock_acquired;	/* device lock acquisitions */
+	__u64 lock_wait;	/* total wait for the device lock in ns */
+	__u64 lock_wait_max;	/* longest wait for the device lock in ns */
+	__u64 suspends;		/* ports put to sleep by power management */
+	__u64 resumes;		/* ports woken up and answering again */
+	__u64 resume_latency;	/* total time until the ports answered in ns */
+	__u64 resume_latency_max;	/* longest resume in ns */
+};
+
 #endif
@@ -0,0 +1,482 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Transfer capture and replay for the Si700x USB Evaluation Board driver.
+ *
+ * record puts a file in SI700X_CAPTURE mode and saves every packet and
+ * control request the driver exchanges with the board until interrupted.
+ * replay sends the captured requests again, at the captured pacing or as
+ * fast as possible, and compares the status of every response with the
+ * captured one. It goes through the transports of libsi700x, so a capture
+ * can also be replayed on a board, or a board emulator, driven by libusb.
+ * dump prints a capture. The file holds a header followed by the records,
+ * each one the 32 byte head of struct si700x_capture and then the control
+ * data or the transfer requests of the packet.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "libsi700x.h"
+
+#define CAPTURE_MAGIC    0x53493743
+#define CAPTURE_VERSION  1
+#define CAPTURE_HEAD     offsetof(struct si700x_capture, data)
+#define READ_RECORDS     32
+
+struct capture_header {
+	uint32_t magic;			/* CAPTURE_MAGIC */
+	uint16_t version;		/* CAPTURE_VERSION */
+	uint16_t head;			/* bytes in the head of a record */
+};
+
+struct replay_stats {
+	unsigned long packets;
+	unsigned long requests;
+	unsigned long controls;
+	unsigned long mismatches;	/* responses unlike the captured ones */
+	unsigned long errors;		/* failed system calls */
+	unsigned long skipped;		/* records that can't be replayed */
+};
+
+static const char *device = "/dev/si700x0";
+static int fast;
+static int verbose;
+static volatile sig_atomic_t running = 1;
+
+static void stop(int sig)
+{
+	(void)sig;
+	running = 0;
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t deadline)
+{
+	struct timespec ts;
+
+	ts.tv_sec = deadline / 1000000000ULL;
+	ts.tv_nsec = deadline % 1000000000ULL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts,
+			NULL) == EINTR && running)
+		;
+}
+
+/* Bytes following the head of a record */
+static size_t record_body(const struct si700x_capture *record)
+{
+	if (record->type == CAPTURE_CONTROL)
+		return sizeof(record->data);
+	return record->count * sizeof(struct transfer_req);
+}
+
+static int write_record(FILE *file, const struct si700x_capture *record)
+{
+	const unsigned char *body;
+
+	if (record->type == CAPTURE_CONTROL)
+		body = record->data;
+	else
+		body = (const unsigned char *)record->reqs;
+	if (fwrite(record, CAPTURE_HEAD, 1, file) != 1)
+		return -1;
+	if (record_body(record) &&
+			fwrite(body, record_body(record), 1, file) != 1)
+		return -1;
+	return 0;
+}
+
+/* Returns 1, 0 at the end of the file or -1 on a bad record */
+static int read_record(FILE *file, struct si700x_capture *record)
+{
+	unsigned char *body;
+
+	memset(record, 0x00, sizeof(*record));
+	if (fread(record, CAPTURE_HEAD, 1, file) != 1)
+		return 0;
+	if (record->type == CAPTURE_CONTROL) {
+		body = record->data;
+	} else if ((record->type == CAPTURE_PACKET_OUT ||
+			record->type == CAPTURE_PACKET_IN) &&
+			record->count <= MAX_XFER_COUNT) {
+		body = (unsigned char *)record->reqs;
+	} else {
+		return -1;
+	}
+	if (record_body(record) &&
+			fread(body, record_body(record), 1, file) != 1)
+		return -1;
+	return 1;
+}
+
+static FILE *open_capture(const char *path)
+{
+	struct capture_header header;
+	FILE *file;
+
+	file = fopen(path, "rb");
+	if (!file) {
+		fprintf(stderr, "Cannot open %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	if (fread(&header, sizeof(header), 1, file) != 1 ||
+			header.magic != CAPTURE_MAGIC ||
+			header.version != CAPTURE_VERSION ||
+			header.head != CAPTURE_HEAD) {
+		fprintf(stderr, "%s is not a capture\n", path);
+		fclose(file);
+		return NULL;
+	}
+	return file;
+}
+
+static int record(const char *path)
+{
+	struct si700x_capture records[READ_RECORDS];
+	struct capture_header header;
+	unsigned long count = 0, lost = 0;
+	ssize_t length;
+	FILE *file;
+	int fd, i;
+
+	fd = open(device, O_RDWR);
+	if (fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", device, strerror(errno));
+		return 1;
+	}
+	if (ioctl(fd, SI700X_CAPTURE, 1) == -1) {
+		fprintf(stderr, "Cannot start the capture: %s\n",
+			strerror(errno));
+		close(fd);
+		return 1;
+	}
+
+	file = fopen(path, "wb");
+	if (!file) {
+		fprintf(stderr, "Cannot create %s: %s\n", path, strerror(errno));
+		close(fd);
+		return 1;
+	}
+	header.magic = CAPTURE_MAGIC;
+	header.version = CAPTURE_VERSION;
+	header.head = CAPTURE_HEAD;
+	if (fwrite(&header, sizeof(header), 1, file) != 1)
+		goto failed;
+
+	while (running) {
+		length = read(fd, records, sizeof(records));
+		if (length < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Cannot read the capture: %s\n",
+				strerror(errno));
+			break;
+		}
+		for (i = 0; i < length / (ssize_t)sizeof(records[0]); i++) {
+			if (write_record(file, &records[i]) < 0)
+				goto failed;
+			lost += records[i].lost;
+			count++;
+		}
+	}
+
+	close(fd);
+	if (fclose(file)) {
+		fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	printf("%lu records captured, %lu lost\n", count, lost);
+	return 0;
+
+failed:
+	fprintf(stderr, "Cannot write %s: %s\n", path, strerror(errno));
+	fclose(file);
+	close(fd);
+	return 1;
+}
+
+/*
+ * Send the requests of a captured packet in one transfer, so they share a
+ * packet again, and compare the statuses with the captured responses.
+ */
+static void replay_packet(struct si700x_transport *t,
+		const struct si700x_capture *out,
+		const struct si700x_capture *in, struct replay_stats *stats)
+{
+	struct transfer_req reqs[MAX_XFER_COUNT];
+	int expected, success;
+	int i;
+
+	stats->packets++;
+	stats->requests += out->count;
+	memcpy(reqs, out->reqs, out->count * sizeof(reqs[0]));
+	if (si700x_transfer(t, reqs, out->count) < 0) {
+		fprintf(stderr, "Cannot replay packet %u: %s\n", out->sequence,
+			strerror(errno));
+		stats->errors++;
+		return;
+	}
+
+	for (i = 0; i < out->count; i++) {
+		success = reqs[i].status == XFER_STATUS_SUCCESS;
+
+		/* a packet lost on the USB level has no statuses */
+		if (!in || in->result < 0)
+			expected = 0;
+		else
+			expected = in->reqs[i].status == XFER_STATUS_SUCCESS;
+		if (success == expected)
+			continue;
+		stats->mismatches++;
+		if (verbose)
+			printf("packet %u request %d slave 0x%02x: %s, "
+				"captured %s\n", out->sequence, i,
+				out->reqs[i].address,
+				success ? "success" : "failed",
+				expected ? "success" : "failed");
+	}
+}
+
+/* Replay a control request and compare the data it read */
+static void replay_control(struct si700x_transport *t,
+		const struct si700x_capture *control,
+		struct replay_stats *stats)
+{
+	unsigned char data[sizeof(control->data)];
+	uint16_t length = control->length;
+	int retval, compare = 0;
+
+	if (control->request > REQ_GET_BOARD_ID) {
+		stats->skipped++;
+		return;
+	}
+	if (length > sizeof(data))
+		length = sizeof(data);
+	memcpy(data, control->data, length);
+
+	retval = si700x_control(t, control->request, control->request_type,
+		control->value, control->index, data, length);
+	if (retval > 0 && (control->request_type & 0x80))
+		compare = memcmp(data, control->data, retval) != 0;
+
+	stats->controls++;
+	if (retval == -1) {
+		if (control->result >= 0) {
+			stats->mismatches++;
+			if (verbose)
+				printf("control %u request %u: %s, captured "
+					"success\n", control->sequence,
+					control->request, strerror(errno));
+		}
+		return;
+	}
+	if (control->result < 0 || (compare && control->result > 0)) {
+		stats->mismatches++;
+		if (verbose)
+			printf("control %u request %u: differs from the "
+				"capture\n", control->sequence,
+				control->request);
+	}
+}
+
+static int replay(const char *path)
+{
+	struct si700x_capture current, next;
+	struct replay_stats stats;
+	uint64_t first = 0, start = 0;
+	struct si700x_transport *t;
+	int retval = 0, have_next = 0;
+	FILE *file;
+
+	file = open_capture(path);
+	if (!file)
+		return 1;
+	t = si700x_transport_open(device);
+	if (!t) {
+		fprintf(stderr, "Cannot open %s: %s\n", device, strerror(errno));
+		fclose(file);
+		return 1;
+	}
+
+	memset(&stats, 0x00, sizeof(stats));
+	while (running) {
+		if (have_next) {
+			current = next;
+			have_next = 0;
+		} else {
+			retval = read_record(file, &current);
+			if (retval <= 0)
+				break;
+		}
+		if (current.type == CAPTURE_PACKET_IN)
+			continue;
+
+		/* the response of a packet is captured right after it */
+		if (current.type == CAPTURE_PACKET_OUT) {
+			retval = read_record(file, &next);
+			if (retval < 0)
+				break;
+			have_next = retval > 0;
+		}
+
+		if (!start) {
+			first = current.time;
+			start = now_ns();
+		} else if (!fast) {
+			sleep_until(start + (current.time - first));
+		}
+
+		if (current.type == CAPTURE_CONTROL) {
+			replay_control(t, &current, &stats);
+		} else if (have_next && next.type == CAPTURE_PACKET_IN &&
+				next.count == current.count) {
+			replay_packet(t, &current, &next, &stats);
+			have_next = 0;
+		} else {
+			replay_packet(t, &current, NULL, &stats);
+		}
+	}
+	if (retval < 0)
+		fprintf(stderr, "%s: bad record\n", path);
+
+	si700x_transport_close(t);
+	fclose(file);
+	printf("%lu packets, %lu requests, %lu control requests replayed "
+		"in %.3f s\n", stats.packets, stats.requests, stats.controls,
+		start ? (now_ns() - start) / 1e9 : 0.0);
+	printf("%lu mismatches, %lu errors, %lu skipped\n", stats.mismatches,
+		stats.errors, stats.skipped);
+	return retval < 0 || stats.mismatches || stats.errors;
+}
+
+static int dump(const char *path)
+{
+	struct si700x_capture r;
+	uint64_t first = 0;
+	int i, retval;
+	FILE *file;
+
+	file = open_capture(path);
+	if (!file)
+		return 1;
+
+	while ((retval = read_record(file, &r)) > 0) {
+		if (!first)
+			first = r.time;
+		printf("%10.6f %8u ", (r.time - first) / 1e9, r.sequence);
+		if (r.lost)
+			printf("(%u lost) ", r.lost);
+		if (r.type == CAPTURE_CONTROL) {
+			printf("control %02x request %u value %u index %u "
+				"length %u result %d", r.request_type,
+				r.request, r.value, r.index, r.length,
+				r.result);
+			for (i = 0; i < r.length && i < (int)sizeof(r.data); i++)
+				printf(" %02x", r.data[i]);
+		} else {
+			printf("%s result %d", r.type == CAPTURE_PACKET_OUT ?
+				"out" : "in ", r.result);
+			for (i = 0; i < r.count; i++)
+				printf(" [%02x %02x %02x %u: %02x %02x %02x %02x]",
+					r.reqs[i].type, r.reqs[i].status,
+					r.reqs[i].address, r.reqs[i].length,
+					r.reqs[i].data[0], r.reqs[i].data[1],
+					r.reqs[i].data[2], r.reqs[i].data[3]);
+		}
+		printf("\n");
+	}
+	fclose(file);
+	if (retval < 0) {
+		fprintf(stderr, "%s: bad record\n", path);
+		return 1;
+	}
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-d device] [-f] [-v] record|replay|dump file\n"
+		"  -d  device node, default /dev/si700x0, or usb:N to replay\n"
+		"      on the Nth board through libusb\n"
+		"  -f  replay as fast as possible instead of the captured pacing\n"
+		"  -v  print every response that differs from the capture\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *command, *path;
+	struct sigaction action;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:fv")) != -1) {
+		switch (opt) {
+		case 'd':
+			device = optarg;
+			break;
+		case 'f':
+			fast = 1;
+			break;
+		case 'v':
+			verbose = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (argc - optind != 2) {
+		usage(argv[0]);
+		return 1;
+	}
+	command = argv[optind];
+	path = argv[optind + 1];
+
+	/* no SA_RESTART, a blocked read of the capture must return */
+	memset(&action, 0x00, sizeof(action));
+	action.sa_handler = stop;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+
+	if (strcmp(command, "record") == 0)
+		return record(path);
+	if (strcmp(command, "replay") == 0)
+		return replay(path);
+	if (strcmp(command, "dump") == 0)
+		return dump(path);
+	usage(argv[0]);
+	return 1;
+}
@@ -0,0 +1,374 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * OpenMetrics exporter for the Si700x USB Evaluation Boards.
+ *
+ * The readings and the driver counters are copied from the shared memory
+ * snapshot of si700xd, so a scrape never measures anything and never
+ * waits for a board. Requests are served one at a time.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "libsi700x.h"
+
+#define DEFAULT_PORT     9700
+#define REQUEST_SIZE     1024
+#define RESPONSE_SIZE    (64 * 1024)	/* initial size, grown as needed */
+#define CLIENT_TIMEOUT   1		/* seconds to receive or send */
+
+struct response {
+	char *data;
+	size_t length;
+	size_t size;
+	int failed;			/* out of memory, the body is cut */
+};
+
+static const char *status_names[XFER_STATUS_COUNT] = {
+	[XFER_STATUS_NONE] = "none",
+	[XFER_STATUS_SUCCESS] = "success",
+	[XFER_STATUS_ADDR_NAK] = "addr_nak",
+	[XFER_STATUS_DATA_NAK] = "data_nak",
+	[XFER_STATUS_TIMEOUT] = "timeout",
+	[XFER_STATUS_ARBLOST] = "arblost",
+	[XFER_STATUS_BAD_LENGTH] = "bad_length",
+	[XFER_STATUS_BAD_MODE] = "bad_mode",
+	[XFER_STATUS_BAD_STATE] = "bad_state",
+};
+
+static void emit(struct response *r, const char *format, ...)
+{
+	va_list args;
+	size_t size;
+	char *data;
+	int length;
+
+	if (r->failed)
+		return;
+	for (;;) {
+		va_start(args, format);
+		length = vsnprintf(r->data + r->length, r->size - r->length,
+			format, args);
+		va_end(args);
+		if (length < 0)
+			return;
+		if ((size_t)length < r->size - r->length)
+			break;
+
+		/* grow the buffer and format again */
+		size = r->size * 2;
+		while (size - r->length <= (size_t)length)
+			size *= 2;
+		data = realloc(r->data, size);
+		if (!data) {
+			r->failed = 1;
+			return;
+		}
+		r->data = data;
+		r->size = size;
+	}
+	r->length += length;
+}
+
+/* Print a milli-unit value as a decimal number */
+static void emit_milli(struct response *r, int32_t value)
+{
+	int64_t v = value;
+
+	emit(r, "%s%lld.%03lld", v < 0 ? "-" : "",
+		(long long)(v < 0 ? -v : v) / 1000,
+		(long long)(v < 0 ? -v : v) % 1000);
+}
+
+static void emit_reading(struct response *r, const char *name, int board,
+		const struct si700x_shm_reading *reading, int32_t value)
+{
+	emit(r, "%s{board=\"%d\",port=\"%d\",address=\"0x%02x\"} ", name,
+		board, reading->port, reading->address);
+	emit_milli(r, value);
+	emit(r, " %llu.%03llu\n",
+		(unsigned long long)(reading->time / 1000000000ULL),
+		(unsigned long long)(reading->time % 1000000000ULL / 1000000));
+}
+
+static void render(const struct si700x_shm *shm, struct response *r)
+{
+	static struct si700x_shm_board boards[SI700X_SHM_BOARDS];
+	const struct si700x_shm_reading *reading;
+	const struct si700x_stats *stats;
+	unsigned int b, i;
+
+	/* one consistent copy per board, the daemon is never held up */
+	for (b = 0; b < SI700X_SHM_BOARDS; b++)
+		if (si700x_shm_read(&shm->boards[b], &boards[b]) < 0)
+			memset(&boards[b], 0x00, sizeof(boards[b]));
+
+	r->length = 0;
+	r->failed = 0;
+	if (!r->data) {
+		r->data = malloc(RESPONSE_SIZE);
+		r->size = RESPONSE_SIZE;
+		r->failed = !r->data;
+	}
+
+	emit(r, "# TYPE si700x_board_up gauge\n"
+		"# HELP si700x_board_up Board opened by si700xd\n");
+	for (b = 0; b < SI700X_SHM_BOARDS; b++)
+		if (boards[b].present)
+			emit(r, "si700x_board_up{board=\"%d\"} 1\n", b);
+
+	emit(r, "# TYPE si700x_temperature_celsius gauge\n"
+		"# UNIT si700x_temperature_celsius celsius\n"
+		"# HELP si700x_temperature_celsius Last temperature reading\n");
+	for (b = 0; b < SI700X_SHM_BOARDS; b++) {
+		for (i = 0; i < boards[b].count; i++) {
+			reading = &boards[b].slaves[i];
+			if (reading->temperature_status == XFER_STATUS_SUCCESS)
+				emit_reading(r, "si700x_temperature_celsius",
+					b, reading, reading->temperature);
+		}
+	}
+
+	emit(r, "# TYPE si700x_humidity_percent gauge\n"
+		"# UNIT si700x_humidity_percent percent\n"
+		"# HELP si700x_humidity_percent Last relative humidity reading\n");
+	for (b = 0; b < SI700X_SHM_BOARDS; b++) {
+		for (i = 0; i < boards[b].count; i++) {
+			reading = &boards[b].slaves[i];
+			if (reading->humidity_status == XFER_STATUS_SUCCESS)
+				emit_reading(r, "si700x_humidity_percent",
+					b, reading, reading->humidity);
+		}
+	}
+
+	emit(r, "# TYPE si700x_packets counter\n"
+		"# HELP si700x_packets Packets sent on the data pipes\n");
+	for (b = 0; b < SI700X_SHM_BOARDS; b++)
+		if (boards[b].present)
+			emit(r, "si700x_packets_total{board=\"%d\"} %llu\n", b,
+				(unsigned long long)boards[b].stats.packets);
+
+	emit(r, "# TYPE si700x_packet_errors counter\n"
+		"# HELP si700x_packet_errors Packets failed on the USB level\n");
+	for (b = 0; b < SI700X_SHM_BOARDS; b++)
+		if (boards[b].present)
+			emit(r, "si700x_packet_errors_total{board=\"%d\"} %llu\n",
+				b, (unsigned long long)
+				boards[b].stats.packet_errors);
+
+	emit(r, "# TYPE si700x_lock_wait_seconds counter\n"
+		"# HELP si700x_lock_wait_seconds Time spent waiting for the "
+		"device lock\n");
+	for (b = 0; b < SI700X_SHM_BOARDS; b++)
+		if (boards[b].present)
+			emit(r, "si700x_lock_wait_seconds_total{board=\"%d\"} "
+				"%llu.%09llu\n", b, (unsigned long long)
+				(boards[b].stats.lock_wait / 1000000000ULL),
+				(unsigned long long)
+				(boards[b].stats.lock_wait % 1000000000ULL));
+
+	emit(r, "# TYPE si700x_resume_latency_seconds summary\n"
+		"# HELP si700x_resume_latency_seconds Time for the ports to "
+		"answer after a wake up\n");
+	for (b = 0; b < SI700X_SHM_BOARDS; b++) {
+		if (!boards[b].present)
+			continue;
+		stats = &boards[b].stats;
+		emit(r, "si700x_resume_latency_seconds_count{board=\"%d\"} "
+			"%llu\n", b, (unsigned long long)stats->resumes);
+		emit(r, "si700x_resume_latency_seconds_sum{board=\"%d\"} "
+			"%llu.%09llu\n", b, (unsigned long long)
+			(stats->resume_latency / 1000000000ULL),
+			(unsigned long long)
+			(stats->resume_latency % 1000000000ULL));
+	}
+
+	emit(r, "# TYPE si700x_transfers counter\n"
+		"# HELP si700x_transfers Transfer responses per status\n");
+	for (b = 0; b < SI700X_SHM_BOARDS; b++) {
+		if (!boards[b].present)
+			continue;
+		stats = &boards[b].stats;
+		for (i = 0; i < XFER_STATUS_COUNT; i++)
+			if (status_names[i])
+				emit(r, "si700x_transfers_total{board=\"%d\","
+					"status=\"%s\"} %llu\n", b,
+					status_names[i],
+					(unsigned long long)stats->status[i]);
+		emit(r, "si700x_transfers_total{board=\"%d\","
+			"status=\"unknown\"} %llu\n", b,
+			(unsigned long long)stats->status_unknown);
+	}
+
+	emit(r, "# EOF\n");
+}
+
+/* Write all of a buffer, a client not reading for CLIENT_TIMEOUT fails */
+static int write_all(int fd, const char *data, size_t length)
+{
+	ssize_t done;
+
+	while (length) {
+		done = write(fd, data, length);
+		if (done < 0 && errno == EINTR)
+			continue;
+		if (done <= 0)
+			return -1;
+		data += done;
+		length -= done;
+	}
+	return 0;
+}
+
+static void reply(int fd, const char *status, const char *type,
+		const char *body, size_t length)
+{
+	char header[256];
+	int header_length;
+
+	header_length = snprintf(header, sizeof(header),
+		"HTTP/1.0 %s\r\nContent-Type: %s\r\n"
+		"Content-Length: %zu\r\nConnection: close\r\n\r\n",
+		status, type, length);
+	if (write_all(fd, header, header_length) == 0 && length)
+		write_all(fd, body, length);
+}
+
+static void serve(int fd)
+{
+	static struct response response;
+	struct si700x_shm *shm;
+	char request[REQUEST_SIZE];
+	struct timeval timeout = { CLIENT_TIMEOUT, 0 };
+	size_t length = 0;
+	ssize_t done;
+
+	/* a slow client must not hold up the next scrapes */
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+	/* only the request line matters */
+	while (length < sizeof(request) - 1) {
+		done = read(fd, request + length, sizeof(request) - 1 - length);
+		if (done <= 0)
+			return;
+		length += done;
+		request[length] = '\0';
+		if (strchr(request, '\n'))
+			break;
+	}
+	request[length] = '\0';
+
+	if (strncmp(request, "GET /metrics ", 13) != 0 &&
+			strncmp(request, "GET /metrics?", 13) != 0) {
+		reply(fd, "404 Not Found", "text/plain", "Not Found\n", 10);
+		return;
+	}
+
+	/* mapped per scrape so a restarted si700xd is picked up */
+	shm = si700x_shm_open(0);
+	if (!shm) {
+		reply(fd, "503 Service Unavailable", "text/plain",
+			"si700xd is not running\n", 23);
+		return;
+	}
+	render(shm, &response);
+	si700x_shm_close(shm);
+	if (response.failed) {
+		reply(fd, "500 Internal Server Error", "text/plain",
+			"Out of memory\n", 14);
+		return;
+	}
+	reply(fd, "200 OK", "application/openmetrics-text; version=1.0.0; "
+		"charset=utf-8", response.data, response.length);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-p port]\n"
+		"  -p  TCP port to listen on, default %d\n",
+		name, DEFAULT_PORT);
+}
+
+int main(int argc, char *argv[])
+{
+	struct sockaddr_in addr;
+	int port = DEFAULT_PORT;
+	int opt, sock, fd;
+	int one = 1;
+
+	while ((opt = getopt(argc, argv, "p:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (port <= 0 || port > 65535) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock < 0) {
+		fprintf(stderr, "Cannot create socket: %s\n", strerror(errno));
+		return 1;
+	}
+	setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+	memset(&addr, 0x00, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+			listen(sock, 16) < 0) {
+		fprintf(stderr, "Cannot listen on port %d: %s\n", port,
+			strerror(errno));
+		return 1;
+	}
+
+	/* a client closing early must not kill the exporter */
+	signal(SIGPIPE, SIG_IGN);
+
+	for (;;) {
+		fd = accept(sock, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Cannot accept: %s\n", strerror(errno));
+			continue;
+		}
+		serve(fd);
+		close(fd);
+	}
+	return 0;
+}
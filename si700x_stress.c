@@ -0,0 +1,538 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Contention stress test for the Si700x USB Evaluation Board driver.
+ *
+ * Every thread opens the devices on its own, or with -S all the threads
+ * share one file per device, and runs a random mix of batched
+ * write()/read() of device ID registers, SI700X_MEASURE and SI700X_VERSION
+ * for a while. The responses of a shared file come back in the order of
+ * the writes, whichever thread reads them, so the threads write and read
+ * their batches on it in turn while the ioctls run alongside. Every
+ * response is checked against its own request : the type, address and
+ * length must match and a device ID must be the one the driver found at
+ * its scan. The test is repeated for each thread count, reporting
+ * throughput, mismatches, latency percentiles and the wait for the device
+ * lock from the SI700X_STATS counters.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "si700x.h"
+
+#define MAX_DEVICES  16
+#define MAX_THREADS  256
+
+enum {
+	OP_BATCH,			/* write() and read() of a batch */
+	OP_MEASURE,			/* SI700X_MEASURE */
+	OP_IOCTL,			/* SI700X_VERSION */
+	OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = { "batch", "measure", "ioctl" };
+
+struct device {
+	const char *path;
+	int fd;				/* for the counters */
+	int shared_fd;			/* file of all the threads with -S */
+	pthread_mutex_t batch_lock;	/* one batch at a time on shared_fd */
+	short version;
+	unsigned int count;		/* slaves */
+	unsigned char address[MAX_SLAVE_COUNT];
+	unsigned char device_id[MAX_SLAVE_COUNT];
+	int known[MAX_SLAVE_COUNT];	/* device_id is valid */
+	struct si700x_stats before;
+};
+
+/* Latencies of one operation type, in microseconds */
+struct latencies {
+	unsigned int *values;
+	size_t count;
+	size_t size;
+};
+
+struct worker {
+	pthread_t thread;
+	unsigned int seed;
+	int fds[MAX_DEVICES];
+	unsigned long ops[OP_COUNT];
+	unsigned long errors[OP_COUNT];	/* failed operations or transfers */
+	unsigned long mismatches;
+	struct latencies latency[OP_COUNT];
+};
+
+static struct device devices[MAX_DEVICES];
+static unsigned int device_count;
+static struct worker workers[MAX_THREADS];
+static unsigned int weights[OP_COUNT] = { 8, 1, 1 };
+static unsigned int batch = 8;
+static unsigned int seconds = 5;
+static int shared;
+static volatile int running;
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void add_latency(struct latencies *l, unsigned int value)
+{
+	unsigned int *values;
+
+	if (l->count == l->size) {
+		l->size = l->size ? l->size * 2 : 4096;
+		values = realloc(l->values, l->size * sizeof(*values));
+		if (!values) {
+			l->size = l->count;
+			return;
+		}
+		l->values = values;
+	}
+	l->values[l->count++] = value;
+}
+
+static int compare(const void *a, const void *b)
+{
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Pick a slave of a device, or one of the default addresses */
+static unsigned char pick_slave(struct worker *w, struct device *d, int *slot)
+{
+	*slot = -1;
+	if (!d->count)
+		return 0x40 + rand_r(&w->seed) % 4;
+	*slot = rand_r(&w->seed) % d->count;
+	return d->address[*slot];
+}
+
+/*
+ * Throw away the responses left in the ring of a file after a read failed
+ * other than on a transfer, so that the next batch doesn't get them.
+ */
+static void drain(int fd)
+{
+	struct transfer_req resp;
+	struct pollfd pfd;
+	int i;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	for (i = 0; i < MAX_XFER_BATCH; i++) {
+		/* POLLIN while responses are pending */
+		if (poll(&pfd, 1, 0) != 1 || pfd.revents != POLLIN)
+			return;
+		if (read(fd, &resp, sizeof(resp)) < 0 && errno != EFAULT)
+			return;
+	}
+}
+
+/*
+ * Batch of device ID reads, returns the number of mismatched responses.
+ * A read stops short before a failed transfer and the next read reports
+ * the failure, so the responses come back in several reads.
+ */
+static int op_batch(struct worker *w, struct device *d, int fd)
+{
+	struct transfer_req reqs[MAX_XFER_BATCH], resps[MAX_XFER_BATCH];
+	int slots[MAX_XFER_BATCH];
+	unsigned int i, next = 0;
+	int mismatches = 0;
+	ssize_t done;
+
+	memset(reqs, 0x00, sizeof(reqs));
+	for (i = 0; i < batch; i++) {
+		reqs[i].type = XFER_TYPE_WRITE_READ;
+		reqs[i].address = pick_slave(w, d, &slots[i]);
+		reqs[i].length = 1;
+		reqs[i].data[0] = REG_DEVICE_ID;
+	}
+
+	if (write(fd, reqs, batch * sizeof(reqs[0])) !=
+			(ssize_t)(batch * sizeof(reqs[0])))
+		return -1;
+
+	while (next < batch) {
+		done = read(fd, resps + next, (batch - next) * sizeof(resps[0]));
+		if (done < 0) {
+			if (errno != EFAULT) {
+				drain(fd);
+				return -1;
+			}
+			/* failed transfer, nothing to check */
+			w->errors[OP_BATCH]++;
+			next++;
+			continue;
+		}
+		for (i = next; i < next + done / sizeof(resps[0]); i++) {
+			if (resps[i].type != reqs[i].type ||
+					resps[i].address != reqs[i].address ||
+					resps[i].length != reqs[i].length) {
+				mismatches++;
+				continue;
+			}
+			if (slots[i] >= 0 && d->known[slots[i]] &&
+					resps[i].data[0] != d->device_id[slots[i]])
+				mismatches++;
+		}
+		next += done / sizeof(resps[0]);
+	}
+	return mismatches;
+}
+
+static int op_measure(struct worker *w, struct device *d, int fd)
+{
+	struct si700x_measurement m;
+	unsigned char address, type;
+	int slot;
+
+	memset(&m, 0x00, sizeof(m));
+	address = pick_slave(w, d, &slot);
+	type = rand_r(&w->seed) & 1 ? SAMPLE_HUMIDITY : SAMPLE_TEMPERATURE;
+	m.address = address;
+	m.type = type;
+	if (ioctl(fd, SI700X_MEASURE, &m) == -1)
+		return -1;
+	return m.address != address || m.type != type;
+}
+
+static int op_ioctl(struct device *d, int fd)
+{
+	short version = 0;
+
+	if (ioctl(fd, SI700X_VERSION, &version) == -1)
+		return -1;
+	return version != d->version;
+}
+
+static int pick_op(struct worker *w)
+{
+	unsigned int total = 0, r, op;
+
+	for (op = 0; op < OP_COUNT; op++)
+		total += weights[op];
+	r = rand_r(&w->seed) % total;
+	for (op = 0; op < OP_COUNT; op++) {
+		if (r < weights[op])
+			return op;
+		r -= weights[op];
+	}
+	return OP_BATCH;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct worker *w = arg;
+	unsigned int index;
+	uint64_t start;
+	int op, result;
+
+	while (running) {
+		index = rand_r(&w->seed) % device_count;
+		op = pick_op(w);
+
+		start = now_us();
+		switch (op) {
+		case OP_BATCH:
+			if (shared)
+				pthread_mutex_lock(&devices[index].batch_lock);
+			result = op_batch(w, &devices[index], w->fds[index]);
+			if (shared)
+				pthread_mutex_unlock(&devices[index].batch_lock);
+			break;
+		case OP_MEASURE:
+			result = op_measure(w, &devices[index], w->fds[index]);
+			break;
+		default:
+			result = op_ioctl(&devices[index], w->fds[index]);
+			break;
+		}
+		add_latency(&w->latency[op], now_us() - start);
+
+		w->ops[op]++;
+		if (result < 0)
+			w->errors[op]++;
+		else
+			w->mismatches += result;
+	}
+	return NULL;
+}
+
+static unsigned int percentile(const struct latencies *l, unsigned int per_mille)
+{
+	size_t index;
+
+	if (!l->count)
+		return 0;
+	index = l->count * per_mille / 1000;
+	if (index >= l->count)
+		index = l->count - 1;
+	return l->values[index];
+}
+
+/* Run the mix with a number of threads and print the results */
+static int run(unsigned int threads)
+{
+	struct latencies all[OP_COUNT];
+	unsigned long ops[OP_COUNT], errors[OP_COUNT], mismatches = 0;
+	struct si700x_stats after;
+	uint64_t lock_wait = 0, lock_acquired = 0, lock_wait_max = 0;
+	int max_since_plug = 0;
+	struct worker *w;
+	unsigned int t, i, op;
+	uint64_t start, elapsed;
+
+	memset(all, 0x00, sizeof(all));
+	memset(ops, 0x00, sizeof(ops));
+	memset(errors, 0x00, sizeof(errors));
+
+	for (i = 0; shared && i < device_count; i++) {
+		devices[i].shared_fd = open(devices[i].path, O_RDWR);
+		if (devices[i].shared_fd < 0) {
+			fprintf(stderr, "Cannot open %s: %s\n",
+				devices[i].path, strerror(errno));
+			return -1;
+		}
+	}
+	for (t = 0; t < threads; t++) {
+		w = &workers[t];
+		memset(w, 0x00, sizeof(*w));
+		w->seed = t * 7919 + 1;
+		for (i = 0; i < device_count; i++) {
+			if (shared) {
+				w->fds[i] = devices[i].shared_fd;
+				continue;
+			}
+			/* every thread is a separate client of the driver */
+			w->fds[i] = open(devices[i].path, O_RDWR);
+			if (w->fds[i] < 0) {
+				fprintf(stderr, "Cannot open %s: %s\n",
+					devices[i].path, strerror(errno));
+				return -1;
+			}
+		}
+	}
+	for (i = 0; i < device_count; i++)
+		ioctl(devices[i].fd, SI700X_STATS, &devices[i].before);
+
+	running = 1;
+	start = now_us();
+	for (t = 0; t < threads; t++)
+		pthread_create(&workers[t].thread, NULL, worker_thread,
+			&workers[t]);
+	sleep(seconds);
+	running = 0;
+	for (t = 0; t < threads; t++)
+		pthread_join(workers[t].thread, NULL);
+	elapsed = now_us() - start;
+
+	for (i = 0; i < device_count; i++) {
+		if (ioctl(devices[i].fd, SI700X_STATS, &after) == -1)
+			continue;
+		lock_acquired += after.lock_acquired -
+			devices[i].before.lock_acquired;
+		lock_wait += after.lock_wait - devices[i].before.lock_wait;
+		/*
+		 * the driver keeps the maximum since the board was plugged
+		 * in, it only belongs to this run if the run raised it
+		 */
+		if (after.lock_wait_max <= devices[i].before.lock_wait_max)
+			max_since_plug = 1;
+		if (after.lock_wait_max > lock_wait_max)
+			lock_wait_max = after.lock_wait_max;
+	}
+
+	for (t = 0; t < threads; t++) {
+		w = &workers[t];
+		for (i = 0; !shared && i < device_count; i++)
+			close(w->fds[i]);
+		for (op = 0; op < OP_COUNT; op++) {
+			ops[op] += w->ops[op];
+			errors[op] += w->errors[op];
+			for (i = 0; i < w->latency[op].count; i++)
+				add_latency(&all[op], w->latency[op].values[i]);
+			free(w->latency[op].values);
+		}
+		mismatches += w->mismatches;
+	}
+	for (i = 0; shared && i < device_count; i++)
+		close(devices[i].shared_fd);
+
+	printf("threads %u%s: %.0f ops/s, %lu mismatches, lock wait avg %llu us "
+		"max %s%llu us%s\n", threads, shared ? " sharing a file" : "",
+		(double)(ops[OP_BATCH] + ops[OP_MEASURE] + ops[OP_IOCTL]) *
+		1000000 / elapsed, mismatches,
+		(unsigned long long)(lock_acquired ?
+			lock_wait / lock_acquired / 1000 : 0),
+		max_since_plug ? "<= " : "",
+		(unsigned long long)(lock_wait_max / 1000),
+		max_since_plug ? " since plug" : "");
+	for (op = 0; op < OP_COUNT; op++) {
+		if (!ops[op])
+			continue;
+		qsort(all[op].values, all[op].count, sizeof(unsigned int),
+			compare);
+		printf("  %-8s %8lu ops %6lu errors  p50 %6u us  p99 %6u us  "
+			"p99.9 %6u us  max %6u us\n", op_names[op], ops[op],
+			errors[op], percentile(&all[op], 500),
+			percentile(&all[op], 990), percentile(&all[op], 999),
+			percentile(&all[op], 1000));
+		free(all[op].values);
+	}
+	return 0;
+}
+
+/* Open a device for the counters and learn its slaves */
+static int setup_device(struct device *d)
+{
+	struct si700x_slave_list list;
+	unsigned int i;
+
+	pthread_mutex_init(&d->batch_lock, NULL);
+	d->fd = open(d->path, O_RDWR);
+	if (d->fd < 0) {
+		fprintf(stderr, "Cannot open %s: %s\n", d->path,
+			strerror(errno));
+		return -1;
+	}
+	if (ioctl(d->fd, SI700X_VERSION, &d->version) == -1) {
+		fprintf(stderr, "Cannot read version of %s: %s\n", d->path,
+			strerror(errno));
+		return -1;
+	}
+	if (ioctl(d->fd, SI700X_SLAVES, &list) == -1)
+		list.count = 0;
+	d->count = list.count < MAX_SLAVE_COUNT ? list.count : MAX_SLAVE_COUNT;
+	for (i = 0; i < d->count; i++) {
+		d->address[i] = list.slaves[i].address;
+		d->device_id[i] = list.slaves[i].device_id;
+		/* 0 if the scan could not read it */
+		d->known[i] = list.slaves[i].device_id != 0;
+	}
+	printf("%s: version %d, %u slaves\n", d->path, d->version, d->count);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-d device]... [-t threads,...] [-s seconds] "
+		"[-b batch] [-m batch,measure,ioctl] [-S]\n"
+		"  -d  device node, default /dev/si700x0, may be repeated\n"
+		"  -t  thread counts to run, default 1,2,4,8,16\n"
+		"  -s  seconds per thread count, default %u\n"
+		"  -b  requests per batch, up to %d, default %u\n"
+		"  -m  weights of the operations, default %u,%u,%u\n"
+		"  -S  the threads share one file per device\n",
+		name, seconds, MAX_XFER_BATCH, batch,
+		weights[OP_BATCH], weights[OP_MEASURE], weights[OP_IOCTL]);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int threads[32];
+	unsigned int thread_count = 0;
+	char *list, *token, *save;
+	unsigned int i;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:t:s:b:m:S")) != -1) {
+		switch (opt) {
+		case 'd':
+			if (device_count == MAX_DEVICES) {
+				usage(argv[0]);
+				return 1;
+			}
+			devices[device_count++].path = optarg;
+			break;
+		case 't':
+			list = optarg;
+			for (token = strtok_r(list, ",", &save); token &&
+					thread_count < 32;
+					token = strtok_r(NULL, ",", &save))
+				threads[thread_count++] = atoi(token);
+			break;
+		case 's':
+			seconds = atoi(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'm':
+			if (sscanf(optarg, "%u,%u,%u", &weights[OP_BATCH],
+					&weights[OP_MEASURE],
+					&weights[OP_IOCTL]) != 3) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'S':
+			shared = 1;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if (!device_count)
+		devices[device_count++].path = "/dev/si700x0";
+	if (!thread_count) {
+		for (i = 1; i <= 16; i *= 2)
+			threads[thread_count++] = i;
+	}
+	if (!seconds || !batch || batch > MAX_XFER_BATCH ||
+			!(weights[OP_BATCH] + weights[OP_MEASURE] +
+			weights[OP_IOCTL])) {
+		usage(argv[0]);
+		return 1;
+	}
+	for (i = 0; i < thread_count; i++) {
+		if (!threads[i] || threads[i] > MAX_THREADS) {
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	for (i = 0; i < device_count; i++)
+		if (setup_device(&devices[i]) < 0)
+			return 1;
+
+	for (i = 0; i < thread_count; i++)
+		if (run(threads[i]) < 0)
+			return 1;
+	return 0;
+}
@@ -0,0 +1,339 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+/*
+ * Collector daemon for the Si700x USB Evaluation Boards.
+ *
+ * One thread per /dev/si700xN measures the temperature and the humidity of
+ * every slave the driver found on the board with one SI700X_SNAPSHOT and
+ * publishes the readings of the whole board at once in the shared memory
+ * snapshot described in libsi700x.h. Boards plugged in later are picked
+ * up, boards unplugged are marked absent. With -l the readings are also
+ * appended to a compressed sample log.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "libsi700x.h"
+
+#define DEFAULT_INTERVAL_MS 1000
+#define LOG_FLUSH_MS        60000
+
+struct board {
+	int index;			/* N of /dev/si700xN */
+	int fd;
+	pthread_t thread;
+	struct si700x_shm_board *shm;
+};
+
+static struct si700x_shm *shm;
+static struct board boards[SI700X_SHM_BOARDS];
+static unsigned int interval_ms = DEFAULT_INTERVAL_MS;
+static volatile sig_atomic_t running = 1;
+
+/* sample log shared by the board threads */
+static struct si700x_log_writer *sample_log;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t log_flushed;
+static uint64_t log_last;		/* newest time logged, ms */
+static int log_behind;			/* the clock is behind log_last */
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sleep until the next cycle, deadline is on CLOCK_MONOTONIC */
+static void next_cycle(struct timespec *deadline)
+{
+	deadline->tv_sec += interval_ms / 1000;
+	deadline->tv_nsec += (interval_ms % 1000) * 1000000L;
+	if (deadline->tv_nsec >= 1000000000L) {
+		deadline->tv_sec++;
+		deadline->tv_nsec -= 1000000000L;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline,
+			NULL) == EINTR && running)
+		;
+}
+
+static void publish(struct board *board, int present,
+		const struct si700x_shm_reading *readings, unsigned int count,
+		const struct si700x_stats *stats)
+{
+	si700x_shm_write_begin(board->shm);
+	board->shm->present = present;
+	board->shm->count = count;
+	memcpy(board->shm->slaves, readings, count * sizeof(*readings));
+	if (stats)
+		board->shm->stats = *stats;
+	si700x_shm_write_end(board->shm);
+}
+
+/* Append the good readings of a cycle to the sample log */
+static void log_readings(struct board *board,
+		const struct si700x_shm_reading *readings, unsigned int count)
+{
+	const struct si700x_shm_reading *r;
+	uint64_t now = now_ns() / 1000000;
+	uint64_t time;
+	unsigned int i;
+
+	pthread_mutex_lock(&log_lock);
+	for (i = 0; i < count; i++) {
+		r = &readings[i];
+		if (r->temperature_status != XFER_STATUS_SUCCESS ||
+				r->humidity_status != XFER_STATUS_SUCCESS)
+			continue;
+		/*
+		 * The log only goes forward in time, readings taken after the
+		 * clock was set back keep the last time until it catches up.
+		 */
+		time = r->time / 1000000;
+		if (time < log_last) {
+			if (!log_behind)
+				fprintf(stderr, "Clock stepped back %llu ms, "
+					"logging at the last time\n",
+					(unsigned long long)(log_last - time));
+			log_behind = 1;
+			time = log_last;
+		} else {
+			log_behind = 0;
+			log_last = time;
+		}
+		if (si700x_log_append(sample_log, board->index, r->address,
+				time, r->temperature_raw,
+				r->humidity_raw) < 0)
+			fprintf(stderr, "Cannot log board %d slave 0x%02x: %s\n",
+				board->index, r->address, strerror(errno));
+	}
+	if (now - log_flushed >= LOG_FLUSH_MS) {
+		if (si700x_log_flush(sample_log) < 0)
+			fprintf(stderr, "Cannot flush the sample log: %s\n",
+				strerror(errno));
+		log_flushed = now;
+	}
+	pthread_mutex_unlock(&log_lock);
+}
+
+/* Run one measurement cycle on the board, all the slaves at once */
+static int collect(struct board *board)
+{
+	struct si700x_slave_list list;
+	struct si700x_shm_reading readings[MAX_SLAVE_COUNT];
+	struct si700x_shm_reading *r;
+	struct si700x_snapshot snap;
+	struct si700x_stats stats;
+	unsigned int i, j;
+	uint64_t now;
+
+	if (ioctl(board->fd, SI700X_SLAVES, &list) == -1)
+		return -1;
+
+	memset(&snap, 0x00, sizeof(snap));
+	snap.types = SAMPLE_TEMPERATURE | SAMPLE_HUMIDITY;
+	if (ioctl(board->fd, SI700X_SNAPSHOT, &snap) == -1)
+		return -1;
+	if (snap.count > MAX_SLAVE_COUNT)
+		snap.count = MAX_SLAVE_COUNT;
+	now = now_ns();
+
+	memset(readings, 0x00, sizeof(readings));
+	for (i = 0; i < snap.count; i++) {
+		r = &readings[i];
+		r->address = snap.slaves[i].address;
+		r->port = snap.slaves[i].port;
+		for (j = 0; j < list.count && j < MAX_SLAVE_COUNT; j++)
+			if (list.slaves[j].address == r->address)
+				r->device_id = list.slaves[j].device_id;
+		r->temperature_status = snap.slaves[i].temperature_status;
+		r->temperature_raw = snap.slaves[i].temperature_raw;
+		r->temperature = snap.slaves[i].temperature;
+		r->humidity_status = snap.slaves[i].humidity_status;
+		r->humidity_raw = snap.slaves[i].humidity_raw;
+		r->humidity = snap.slaves[i].humidity;
+		/* the slaves were converted together */
+		r->time = now;
+	}
+
+	/* counters only, this does not touch the board */
+	if (ioctl(board->fd, SI700X_STATS, &stats) == -1)
+		return -1;
+
+	publish(board, 1, readings, i, &stats);
+	if (sample_log)
+		log_readings(board, readings, i);
+	return 0;
+}
+
+static void *board_thread(void *arg)
+{
+	struct board *board = arg;
+	struct timespec deadline;
+	char path[32];
+
+	snprintf(path, sizeof(path), "/dev/si700x%d", board->index);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+
+	while (running) {
+		if (board->fd < 0) {
+			board->fd = open(path, O_RDWR);
+			if (board->fd >= 0)
+				fprintf(stderr, "%s: board attached\n", path);
+		}
+
+		if (board->fd >= 0 && collect(board) < 0) {
+			if (errno != ENODEV && errno != ESHUTDOWN) {
+				/* keep the board, retry at the next cycle */
+				fprintf(stderr, "%s: measurement failed: %s\n",
+					path, strerror(errno));
+			} else {
+				fprintf(stderr, "%s: board detached: %s\n",
+					path, strerror(errno));
+				close(board->fd);
+				board->fd = -1;
+				publish(board, 0, NULL, 0, NULL);
+			}
+		}
+
+		next_cycle(&deadline);
+	}
+
+	if (board->fd >= 0)
+		close(board->fd);
+	publish(board, 0, NULL, 0, NULL);
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-d] [-i interval_ms] [-n boards] [-l log]\n"
+		"  -d  run in the background\n"
+		"  -i  measurement interval in milliseconds, default %d\n"
+		"  -l  append the readings to a compressed sample log\n"
+		"  -n  number of /dev/si700xN to watch, default %d\n",
+		name, DEFAULT_INTERVAL_MS, SI700X_SHM_BOARDS);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int board_count = SI700X_SHM_BOARDS;
+	const char *log_path = NULL;
+	int background = 0;
+	sigset_t signals;
+	unsigned int i;
+	int opt, sig;
+
+	while ((opt = getopt(argc, argv, "di:l:n:")) != -1) {
+		switch (opt) {
+		case 'd':
+			background = 1;
+			break;
+		case 'i':
+			interval_ms = atoi(optarg);
+			break;
+		case 'l':
+			log_path = optarg;
+			break;
+		case 'n':
+			board_count = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (interval_ms == 0 || board_count == 0 ||
+			board_count > SI700X_SHM_BOARDS) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (log_path) {
+		sample_log = si700x_log_create(log_path);
+		if (!sample_log) {
+			fprintf(stderr, "Cannot open sample log %s: %s\n",
+				log_path, strerror(errno));
+			return 1;
+		}
+		log_flushed = now_ns() / 1000000;
+	}
+
+	if (background && daemon(0, 0) == -1) {
+		fprintf(stderr, "Cannot run in the background: %s\n",
+			strerror(errno));
+		return 1;
+	}
+
+	shm = si700x_shm_open(1);
+	if (!shm) {
+		fprintf(stderr, "Cannot create shared memory %s: %s\n",
+			SI700X_SHM_NAME, strerror(errno));
+		return 1;
+	}
+
+	/* only the main thread takes the signals */
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	for (i = 0; i < board_count; i++) {
+		boards[i].index = i;
+		boards[i].fd = -1;
+		boards[i].shm = &shm->boards[i];
+		if (pthread_create(&boards[i].thread, NULL, board_thread,
+				&boards[i])) {
+			fprintf(stderr, "Cannot start thread for board %d\n", i);
+			board_count = i;
+			running = 0;
+			break;
+		}
+	}
+
+	if (running)
+		sigwait(&signals, &sig);
+	running = 0;
+
+	for (i = 0; i < board_count; i++)
+		pthread_join(boards[i].thread, NULL);
+
+	si700x_shm_close(shm);
+	shm_unlink(SI700X_SHM_NAME);
+
+	if (sample_log && si700x_log_close(sample_log) < 0) {
+		fprintf(stderr, "Cannot flush the sample log: %s\n",
+			strerror(errno));
+		return 1;
+	}
+	return 0;
+}
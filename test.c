@@ -7,15 +7,6 @@
 
 #include "si700x.h"
 
-/* Usb transfer request */
-struct transfer_req {
-	char type;
-	char status;
-	char address;
-	char length;
-	char data[4];
-} __attribute__ ((__packed__));
-
 int fd;			/* the deivce file */
 int fast_conv = 0;
 unsigned char board_address = 0x00;
@@ -26,6 +17,7 @@ int get_humidity(void);
 void fast_conversion(int);
 int heater(int);
 unsigned char get_device_id();
+void print_milli(int);
 
 #define DELAY sleep(1)
 
@@ -37,8 +29,10 @@ int main()
 	unsigned int port_id;
 	unsigned char address = 0x00;
 	unsigned char sensor_device_id;
+	struct si700x_slave_list slave_list;
 
 	int temperature;
+	int temperature_ok = 0;
 	int humidity;
 
 	fd = open("/dev/si700x0", O_RDWR);
@@ -85,14 +79,20 @@ int main()
 		}
 	}
 
-	/* give time for the ports to wake up */
-	sleep(10);
-
+	/* SI700X_SETSLEEP_OFF returns once the port answers */
 	// heater(0);
 	fast_conversion(0);
 
-	/* scan for board address */
-	for (address = 0x40; address <= 0x43; address++) {
+	/* use the slaves found by the driver, scan if it found none */
+	if (ioctl(fd, SI700X_SLAVES, &slave_list) == -1) {
+		printf("Failed to read slave list: %s\n", strerror(errno));
+		slave_list.count = 0;
+	}
+	if (slave_list.count > 0) {
+		board_address = slave_list.slaves[0].address;
+		printf("Board found at address 0x%X\n", board_address);
+	}
+	for (address = 0x40; !board_address && address <= 0x43; address++) {
 		if (board_status(address)) {
 			board_address = address;
 			printf("Board found at address 0x%X\n", board_address);
@@ -118,17 +118,24 @@ int main()
 	if (temperature < 0) {
 		printf("Error reading temperature\n");
 	} else {
-		printf("Current temperature is : %f\n", (((float)temperature / 32.0) - 50.0));
+		temperature = TEMPERATURE_MILLI(temperature);
+		temperature_ok = 1;
+		printf("Current temperature is : ");
+		print_milli(temperature);
 	}
 
 	DELAY;
 
-	/* read humidity */
+	/* read humidity, compensated with the temperature read above */
 	humidity = get_humidity();
 	if (humidity < 0) {
 		printf("Error reading humidity\n");
 	} else {
-		printf("Current humidity is : %f\n", (((float)humidity / 16.0) - 24.0));
+		humidity = HUMIDITY_LINEAR(HUMIDITY_MILLI(humidity));
+		if (temperature_ok)
+			humidity = HUMIDITY_COMPENSATE(humidity, temperature);
+		printf("Current humidity is : ");
+		print_milli(HUMIDITY_CLAMP(humidity));
 	}
 
 	if (ioctl(fd, SI700X_LED_OFF) == -1) {
@@ -571,3 +578,15 @@ unsigned char get_device_id()
 	value = value >> 4;
 	return value;
 }
+
+/*
+ * Print a value in thousandths, as returned by the conversion macros
+ */
+void print_milli(int value)
+{
+	if (value < 0) {
+		putchar('-');
+		value = -value;
+	}
+	printf("%d.%03d\n", value / 1000, value % 1000);
+}
@@ -0,0 +1,167 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * Checks of the conversion macros of si700x.h and of the batch decoders of
+ * libsi700x. The macros are compared with the floating point formulas of
+ * the Si7005 datasheet, the tables with the macros, and the decoders, which
+ * use AVX2 or SSE4.1 when the processor has them, with the scalar macros on
+ * batches of every length up to a few vectors.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "libsi700x.h"
+
+#define MAX_RECORDS  67
+
+static int failures;
+
+static void check(int ok, const char *what, long value, long expected)
+{
+	if (ok)
+		return;
+	printf("FAIL %s: %ld, expected %ld\n", what, value, expected);
+	failures++;
+}
+
+static void check_equal(const char *what, long value, long expected)
+{
+	check(value == expected, what, value, expected);
+}
+
+static void test_macros(void)
+{
+	double rh, linear, compensated;
+	int raw, t, value;
+
+	check_equal("TEMPERATURE_RAW", TEMPERATURE_RAW(0x12, 0x34), 1165);
+	check_equal("HUMIDITY_RAW", HUMIDITY_RAW(0x12, 0x34), 291);
+	check_equal("TEMPERATURE_RAW max", TEMPERATURE_RAW(0xFF, 0xFF),
+		TEMPERATURE_CODES - 1);
+	check_equal("HUMIDITY_RAW max", HUMIDITY_RAW(0xFF, 0xFF),
+		HUMIDITY_CODES - 1);
+
+	check_equal("TEMPERATURE_MILLI 0", TEMPERATURE_MILLI(0), -50000);
+	check_equal("TEMPERATURE_MILLI 1600", TEMPERATURE_MILLI(1600), 0);
+	check_equal("TEMPERATURE_MILLI 2400", TEMPERATURE_MILLI(2400), 25000);
+	check_equal("HUMIDITY_MILLI 384", HUMIDITY_MILLI(384), 0);
+	check_equal("HUMIDITY_MILLI 1184", HUMIDITY_MILLI(1184), 50000);
+	check_equal("HUMIDITY_CLAMP low", HUMIDITY_CLAMP(-5), 0);
+	check_equal("HUMIDITY_CLAMP high", HUMIDITY_CLAMP(100001), 100000);
+	check_equal("HUMIDITY_CLAMP", HUMIDITY_CLAMP(42000), 42000);
+
+	/* fixed point against the datasheet formulas, within 2 milli-percent */
+	for (raw = 384; raw < 16 * 100 + 384; raw += 7) {
+		rh = (raw / 16.0 - HUMIDITY_OFFSET);
+		linear = rh - (-0.00393 * rh * rh + 0.4008 * rh - 4.7844);
+		value = HUMIDITY_LINEAR(HUMIDITY_MILLI(raw));
+		check(abs(value - (int)(linear * 1000)) <= 2,
+			"HUMIDITY_LINEAR", value, (long)(linear * 1000));
+
+		for (t = -10000; t <= 70000; t += 20000) {
+			compensated = linear + (t / 1000.0 - 30) *
+				(linear * 0.00237 + 0.1973);
+			value = HUMIDITY_COMPENSATE(
+				HUMIDITY_LINEAR(HUMIDITY_MILLI(raw)), t);
+			check(abs(value - (int)(compensated * 1000)) <= 2,
+				"HUMIDITY_COMPENSATE", value,
+				(long)(compensated * 1000));
+		}
+	}
+	check_equal("HUMIDITY_COMPENSATE 30", HUMIDITY_COMPENSATE(42000, 30000),
+		42000);
+}
+
+static void test_tables(void)
+{
+	int raw, value;
+
+	for (raw = 0; raw < TEMPERATURE_CODES; raw++)
+		check_equal("si700x_temperature", si700x_temperature(raw),
+			TEMPERATURE_MILLI(raw));
+	for (raw = 0; raw < HUMIDITY_CODES; raw++) {
+		value = HUMIDITY_COMPENSATE(HUMIDITY_LINEAR(HUMIDITY_MILLI(raw)),
+			21500);
+		check_equal("si700x_humidity", si700x_humidity(raw, 21500),
+			HUMIDITY_CLAMP(value));
+	}
+}
+
+static void test_decoders(void)
+{
+	struct transfer_req records[MAX_RECORDS];
+	int32_t temperatures[MAX_RECORDS], values[MAX_RECORDS];
+	int32_t expected;
+	unsigned int seed = 1;
+	size_t count, i;
+
+	for (count = 0; count <= MAX_RECORDS; count++) {
+		for (i = 0; i < MAX_RECORDS; i++) {
+			records[i].type = XFER_TYPE_WRITE_READ;
+			records[i].status = XFER_STATUS_SUCCESS;
+			records[i].address = SLAVE_NEW;
+			records[i].length = 2;
+			records[i].data[0] = rand_r(&seed);
+			records[i].data[1] = rand_r(&seed);
+			records[i].data[2] = rand_r(&seed);
+			records[i].data[3] = rand_r(&seed);
+		}
+
+		si700x_decode_temperature(records, count, temperatures);
+		for (i = 0; i < count; i++)
+			check_equal("si700x_decode_temperature",
+				temperatures[i], TEMPERATURE_MILLI(
+				TEMPERATURE_RAW(records[i].data[0],
+				records[i].data[1])));
+
+		si700x_decode_humidity(records, count, temperatures, values);
+		for (i = 0; i < count; i++) {
+			expected = HUMIDITY_COMPENSATE(HUMIDITY_LINEAR(
+				HUMIDITY_MILLI(HUMIDITY_RAW(records[i].data[0],
+				records[i].data[1]))), temperatures[i]);
+			check_equal("si700x_decode_humidity", values[i],
+				HUMIDITY_CLAMP(expected));
+		}
+
+		si700x_decode_humidity(records, count, NULL, values);
+		for (i = 0; i < count; i++) {
+			expected = HUMIDITY_LINEAR(HUMIDITY_MILLI(HUMIDITY_RAW(
+				records[i].data[0], records[i].data[1])));
+			check_equal("si700x_decode_humidity uncompensated",
+				values[i], HUMIDITY_CLAMP(expected));
+		}
+	}
+}
+
+int main()
+{
+	test_macros();
+	test_tables();
+	test_decoders();
+	if (failures) {
+		printf("test_convert: %d failures\n", failures);
+		return 1;
+	}
+	puts("test_convert: ok");
+	return 0;
+}
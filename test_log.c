@@ -0,0 +1,223 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * Round trip of the compressed sample log of libsi700x : records of two
+ * series are appended with irregular intervals and raw results, enough to
+ * fill several blocks, then the log is mapped and every record must come
+ * back from si700x_log_scan() as it was written, and si700x_log_aggregate()
+ * must agree with the records over a range cutting blocks.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "libsi700x.h"
+
+#define RECORDS  20000
+#define SERIES   2
+
+struct scan {
+	const struct si700x_log_record *expected;
+	size_t count;
+	size_t next;
+	int failures;
+};
+
+static struct si700x_log_record records[SERIES][RECORDS];
+static int failures;
+
+static int compare_record(const struct si700x_log_record *r, void *arg)
+{
+	struct scan *scan = arg;
+	const struct si700x_log_record *e;
+
+	if (scan->next == scan->count) {
+		scan->failures++;
+		return 1;
+	}
+	e = &scan->expected[scan->next++];
+	if (r->time != e->time || r->temperature_raw != e->temperature_raw ||
+			r->humidity_raw != e->humidity_raw ||
+			r->temperature != e->temperature ||
+			r->humidity != e->humidity) {
+		printf("FAIL record %zu: time %llu raw %u %u, expected time "
+			"%llu raw %u %u\n", scan->next - 1,
+			(unsigned long long)r->time, r->temperature_raw,
+			r->humidity_raw, (unsigned long long)e->time,
+			e->temperature_raw, e->humidity_raw);
+		scan->failures++;
+		return 1;
+	}
+	return 0;
+}
+
+/* Fill a series with slowly changing readings and some jumps */
+static void generate(struct si700x_log_record *r, unsigned int *seed)
+{
+	uint64_t time = 1350000000000ULL;
+	int temperature = 2400, humidity = 1200;
+	size_t i;
+
+	for (i = 0; i < RECORDS; i++) {
+		time += 1000 + rand_r(seed) % 3;
+		if (rand_r(seed) % 500 == 0)
+			time += rand_r(seed);
+		temperature += rand_r(seed) % 5 - 2;
+		humidity += rand_r(seed) % 5 - 2;
+		if (rand_r(seed) % 200 == 0) {
+			temperature = rand_r(seed) % TEMPERATURE_CODES;
+			humidity = rand_r(seed) % HUMIDITY_CODES;
+		}
+		temperature &= TEMPERATURE_CODES - 1;
+		humidity &= HUMIDITY_CODES - 1;
+
+		r[i].time = time;
+		r[i].temperature_raw = temperature;
+		r[i].humidity_raw = humidity;
+		r[i].temperature = si700x_temperature(temperature);
+		r[i].humidity = si700x_humidity(humidity, r[i].temperature);
+	}
+}
+
+static int write_log(const char *path)
+{
+	struct si700x_log_writer *log;
+	size_t i, s;
+
+	log = si700x_log_create(path);
+	if (!log) {
+		printf("Cannot create %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < RECORDS; i++) {
+		for (s = 0; s < SERIES; s++) {
+			if (si700x_log_append(log, 0, SLAVE_NEW + s,
+					records[s][i].time,
+					records[s][i].temperature_raw,
+					records[s][i].humidity_raw) < 0) {
+				printf("Cannot append: %s\n", strerror(errno));
+				si700x_log_close(log);
+				return -1;
+			}
+		}
+		/* flushed partial blocks must be continued, not duplicated */
+		if (i == RECORDS / 3 && si700x_log_flush(log) < 0) {
+			printf("Cannot flush: %s\n", strerror(errno));
+			si700x_log_close(log);
+			return -1;
+		}
+	}
+
+	/* a series only goes forward in time */
+	if (si700x_log_append(log, 0, SLAVE_NEW, records[0][0].time, 0, 0) == 0 ||
+			errno != EINVAL) {
+		printf("FAIL append back in time was accepted\n");
+		failures++;
+	}
+	return si700x_log_close(log);
+}
+
+static void check_series(const struct si700x_log_reader *log, unsigned int s)
+{
+	const struct si700x_log_record *r = records[s];
+	struct si700x_log_summary summary;
+	struct scan scan;
+	uint64_t from, to;
+	int64_t temperature_sum = 0, humidity_sum = 0;
+	size_t i, found, count = 0;
+
+	memset(&scan, 0x00, sizeof(scan));
+	scan.expected = r;
+	scan.count = RECORDS;
+	found = si700x_log_scan(log, 0, SLAVE_NEW + s, 0, UINT64_MAX,
+		compare_record, &scan);
+	if (found != RECORDS || scan.next != RECORDS || scan.failures) {
+		printf("FAIL series %u: %zu records back of %d\n", s, found,
+			RECORDS);
+		failures++;
+	}
+
+	/* a range starting and ending inside blocks */
+	from = r[RECORDS / 5].time;
+	to = r[RECORDS * 4 / 5].time;
+	si700x_log_aggregate(log, 0, SLAVE_NEW + s, from, to, &summary);
+	for (i = 0; i < RECORDS; i++) {
+		if (r[i].time < from || r[i].time > to)
+			continue;
+		count++;
+		temperature_sum += r[i].temperature;
+		humidity_sum += r[i].humidity;
+	}
+	if (summary.count != count ||
+			summary.temperature_sum != temperature_sum ||
+			summary.humidity_sum != humidity_sum) {
+		printf("FAIL series %u: aggregate of %llu records, expected "
+			"%zu\n", s, (unsigned long long)summary.count, count);
+		failures++;
+	}
+}
+
+int main()
+{
+	struct si700x_log_reader *log;
+	char dir[] = "/tmp/test_log.XXXXXX";
+	char path[64], index_path[64];
+	unsigned int seed = 1;
+	unsigned int s;
+
+	if (!mkdtemp(dir)) {
+		printf("Cannot create a directory: %s\n", strerror(errno));
+		return 1;
+	}
+	snprintf(path, sizeof(path), "%s/log", dir);
+	snprintf(index_path, sizeof(index_path), "%s/log.idx", dir);
+
+	for (s = 0; s < SERIES; s++)
+		generate(records[s], &seed);
+
+	if (write_log(path) == 0) {
+		log = si700x_log_map(path);
+		if (log) {
+			for (s = 0; s < SERIES; s++)
+				check_series(log, s);
+			si700x_log_unmap(log);
+		} else {
+			printf("Cannot map %s: %s\n", path, strerror(errno));
+			failures++;
+		}
+	} else {
+		failures++;
+	}
+
+	unlink(path);
+	unlink(index_path);
+	rmdir(dir);
+	if (failures) {
+		printf("test_log: %d failures\n", failures);
+		return 1;
+	}
+	puts("test_log: ok");
+	return 0;
+}
@@ -0,0 +1,141 @@
+/*
+* Copyright (C) 2012 Prashant Shah, pshah.mumbai@gmail.com
+* Copyright (C) 2012 Silicon Labs, Inc. (www.silabs.com)
+*
+* This program is free software; you can redistribute it and/or modify
+* it under the terms of the GNU General Public License as published by
+* the Free Software Foundation; either version 2 of the License, or
+* (at your option) any later version.
+*
+* This program is distributed in the hope that it will be useful,
+* but WITHOUT ANY WARRANTY; without even the implied warranty of
+* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+* GNU General Public License for more details.
+*
+* You should have received a copy of the GNU General Public License
+* along with this program; if not, write to the Free Software
+* Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+*/
+
+
+/*
+ * Checks of the seqlock of the libsi700x shared memory snapshot. A writer
+ * thread keeps publishing a board where every field holds the same
+ * generation number while readers copy it : a copy must never mix two
+ * generations and must carry an even sequence. A board left in the middle
+ * of an update must make the reader give up with EAGAIN.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "libsi700x.h"
+
+#define READERS       4
+#define GENERATIONS   1000000
+
+static struct si700x_shm_board board;
+static volatile int writing;
+static int started;			/* readers running */
+
+static void *writer_thread(void *arg)
+{
+	uint32_t generation;
+	unsigned int i;
+
+	(void)arg;
+	while (__atomic_load_n(&started, __ATOMIC_ACQUIRE) < READERS)
+		;
+	for (generation = 1; generation <= GENERATIONS; generation++) {
+		si700x_shm_write_begin(&board);
+		board.present = generation;
+		board.count = generation;
+		for (i = 0; i < MAX_SLAVE_COUNT; i++) {
+			board.slaves[i].time = generation;
+			board.slaves[i].temperature = generation;
+			board.slaves[i].humidity = generation;
+		}
+		board.stats.packets = generation;
+		si700x_shm_write_end(&board);
+	}
+	writing = 0;
+	return NULL;
+}
+
+/* Returns the number of torn copies seen */
+static void *reader_thread(void *arg)
+{
+	struct si700x_shm_board copy;
+	unsigned long torn = 0;
+	unsigned int i;
+
+	(void)arg;
+	__atomic_add_fetch(&started, 1, __ATOMIC_RELEASE);
+	while (writing) {
+		if (si700x_shm_read(&board, &copy) < 0)
+			continue;
+		if (copy.sequence & 1)
+			torn++;
+		for (i = 0; i < MAX_SLAVE_COUNT; i++)
+			if (copy.slaves[i].time != copy.present ||
+					copy.slaves[i].temperature !=
+					(int32_t)copy.present ||
+					copy.slaves[i].humidity !=
+					(int32_t)copy.present)
+				torn++;
+		if (copy.count != copy.present ||
+				copy.stats.packets != copy.present)
+			torn++;
+	}
+	return (void *)torn;
+}
+
+int main()
+{
+	pthread_t writer, readers[READERS];
+	struct si700x_shm_board copy;
+	unsigned long torn = 0;
+	void *result;
+	int failures = 0;
+	unsigned int i;
+
+	writing = 1;
+	for (i = 0; i < READERS; i++)
+		pthread_create(&readers[i], NULL, reader_thread, NULL);
+	pthread_create(&writer, NULL, writer_thread, NULL);
+	pthread_join(writer, NULL);
+	for (i = 0; i < READERS; i++) {
+		pthread_join(readers[i], &result);
+		torn += (unsigned long)result;
+	}
+	if (torn) {
+		printf("FAIL %lu torn copies\n", torn);
+		failures++;
+	}
+
+	/* the last generation is read back whole */
+	if (si700x_shm_read(&board, &copy) < 0 ||
+			copy.present != GENERATIONS ||
+			copy.sequence != 2 * GENERATIONS) {
+		printf("FAIL last copy of generation %u\n", copy.present);
+		failures++;
+	}
+
+	/* a writer that died in the middle of an update */
+	si700x_shm_write_begin(&board);
+	errno = 0;
+	if (si700x_shm_read(&board, &copy) != -1 || errno != EAGAIN) {
+		printf("FAIL read of a board left odd didn't give up\n");
+		failures++;
+	}
+
+	if (failures) {
+		printf("test_shm: %d failures\n", failures);
+		return 1;
+	}
+	puts("test_shm: ok");
+	return 0;
+}